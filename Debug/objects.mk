@@ -4,5 +4,5 @@
 
 USER_OBJS :=
 
-LIBS := -lpcan
+LIBS := -lpcan -lpthread
 
@@ -4,18 +4,33 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
+../canif.c \
+../canif_pcan.c \
+../canif_socketcan.c \
 ../main.c \
+../serial_linux.c \
 ../serial_posix.c \
+../stm32eng.c \
 ../stm32ld.c 
 
 OBJS += \
+./canif.o \
+./canif_pcan.o \
+./canif_socketcan.o \
 ./main.o \
+./serial_linux.o \
 ./serial_posix.o \
+./stm32eng.o \
 ./stm32ld.o 
 
 C_DEPS += \
+./canif.d \
+./canif_pcan.d \
+./canif_socketcan.d \
 ./main.d \
+./serial_linux.d \
 ./serial_posix.d \
+./stm32eng.d \
 ./stm32ld.d 
 
 
@@ -23,7 +38,7 @@ C_DEPS += \
 %.o: ../%.c
 	@echo 'Building file: $<'
 	@echo 'Invoking: GCC C Compiler'
-	gcc -include/home/stm32/peak-linux-driver-7.5/lib/libpcan.h -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
+	gcc -DPCAN_BUILD -include/home/stm32/peak-linux-driver-7.5/lib/libpcan.h -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
 	@echo 'Finished building: $<'
 	@echo ' '
 
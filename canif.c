@@ -0,0 +1,113 @@
+// CAN interface: backend selection and dispatch
+
+#include "canif.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Open the CAN port, picking the backend from the port name
+canif_handler canif_open( const char *name )
+{
+  canif_port *port;
+  int res;
+
+  if( ( port = ( canif_port* )calloc( 1, sizeof( canif_port ) ) ) == NULL )
+    return NULL;
+  port->fd = -1;
+
+  if( strncmp( name, "/dev/", 5 ) == 0 )
+  {
+#ifdef PCAN_BUILD
+    port->backend = CANIF_BACKEND_PCAN;
+    res = canif_pcan_open( port, name );
+#else
+    fprintf( stderr, "canif_open: %s needs the PEAK driver, build with PCAN_BUILD\n", name );
+    res = CANIF_ERR;
+#endif
+  }
+  else
+  {
+    port->backend = CANIF_BACKEND_SOCKETCAN;
+    res = canif_socketcan_open( port, name );
+  }
+
+  if( res != CANIF_OK )
+  {
+    free( port );
+    return NULL;
+  }
+  return port;
+}
+
+// Close the CAN port
+void canif_close( canif_handler id )
+{
+#ifdef PCAN_BUILD
+  if( id->backend == CANIF_BACKEND_PCAN )
+    canif_pcan_close( id );
+  else
+#endif
+    canif_socketcan_close( id );
+  free( id );
+}
+
+// Setup the bit rate
+int canif_setup( canif_handler id, u32 bitrate )
+{
+#ifdef PCAN_BUILD
+  if( id->backend == CANIF_BACKEND_PCAN )
+    return canif_pcan_setup( id, bitrate );
+#endif
+  return canif_socketcan_setup( id, bitrate );
+}
+
+// Enable CAN FD frames (up to 64 bytes). The data phase bit rate belongs to
+// the interface configuration (SocketCAN: ip link ... dbitrate 4000000 fd on)
+int canif_enable_fd( canif_handler id )
+{
+#ifdef PCAN_BUILD
+  if( id->backend == CANIF_BACKEND_PCAN )
+  {
+    fprintf( stderr, "canif_enable_fd: CAN FD is not supported by the PEAK driver\n" );
+    return CANIF_ERR;
+  }
+#endif
+  if( canif_socketcan_enable_fd( id ) != CANIF_OK )
+    return CANIF_ERR;
+  id->canfd = 1;
+  return CANIF_OK;
+}
+
+// Largest valid CAN FD frame length not above len
+// (0..8, 12, 16, 20, 24, 32, 48, 64), so frames never need padding
+u32 canif_fd_len( u32 len )
+{
+  static const u8 fdlens[] = { 64, 48, 32, 24, 20, 16, 12 };
+  unsigned i;
+
+  for( i = 0; i < sizeof( fdlens ); i ++ )
+    if( len >= fdlens[ i ] )
+      return fdlens[ i ];
+  return len;
+}
+
+// Write the given frames, return the number of frames actually written
+u32 canif_write( canif_handler id, const canif_msg *msgs, u32 count )
+{
+#ifdef PCAN_BUILD
+  if( id->backend == CANIF_BACKEND_PCAN )
+    return canif_pcan_write( id, msgs, count );
+#endif
+  return canif_socketcan_write( id, msgs, count );
+}
+
+// Wait up to timeout (us) for at least one frame, then return every frame
+// already received (up to maxcount). Returns the number of frames read.
+u32 canif_read( canif_handler id, canif_msg *msgs, u32 maxcount, u32 timeout )
+{
+#ifdef PCAN_BUILD
+  if( id->backend == CANIF_BACKEND_PCAN )
+    return canif_pcan_read( id, msgs, maxcount, timeout );
+#endif
+  return canif_socketcan_read( id, msgs, maxcount, timeout );
+}
@@ -0,0 +1,72 @@
+// STM32 loader CAN interface
+
+#ifndef __CANIF_H__
+#define __CANIF_H__
+
+#include "type.h"
+
+#define CANIF_INF_TIMEOUT       0xFFFFFFFF
+#define CANIF_NO_TIMEOUT        0
+#define CANIF_OK                0
+#define CANIF_ERR               1
+
+#define CANIF_MAX_DLEN          8
+#define CANIF_FD_MAX_DLEN       64
+
+// Backends
+#define CANIF_BACKEND_SOCKETCAN 0
+#define CANIF_BACKEND_PCAN      1
+
+// Message flags
+#define CANIF_MSG_STATUS        0x01 // controller status/error report, not data
+#define CANIF_MSG_FD            0x02 // CAN FD frame (up to 64 bytes)
+#define CANIF_MSG_BRS           0x04 // CAN FD frame sent with the faster data phase bit rate
+
+// A CAN frame, independent of the backend
+typedef struct
+{
+  u32 id;
+  u8 len;
+  u8 flags;
+  u8 data[ CANIF_FD_MAX_DLEN ];
+} canif_msg;
+
+// An open CAN port
+typedef struct
+{
+  int backend;
+  int fd;     // SocketCAN raw socket
+  void *pcan; // PEAK driver handle
+  int canfd;  // CAN FD frames enabled
+} canif_port;
+
+typedef canif_port* canif_handler;
+
+// CAN access functions
+// Names starting with /dev/ select the PEAK driver (if built with PCAN_BUILD),
+// anything else is taken as a SocketCAN interface name (can0, vcan0 ...)
+canif_handler canif_open( const char *name );
+void canif_close( canif_handler id );
+int canif_setup( canif_handler id, u32 bitrate );
+int canif_enable_fd( canif_handler id );
+u32 canif_fd_len( u32 len );
+u32 canif_write( canif_handler id, const canif_msg *msgs, u32 count );
+u32 canif_read( canif_handler id, canif_msg *msgs, u32 maxcount, u32 timeout );
+
+// Backend functions (to be implemented by each backend)
+int canif_socketcan_open( canif_port *port, const char *name );
+void canif_socketcan_close( canif_port *port );
+int canif_socketcan_setup( canif_port *port, u32 bitrate );
+int canif_socketcan_enable_fd( canif_port *port );
+u32 canif_socketcan_write( canif_port *port, const canif_msg *msgs, u32 count );
+u32 canif_socketcan_read( canif_port *port, canif_msg *msgs, u32 maxcount, u32 timeout );
+
+#ifdef PCAN_BUILD
+int canif_pcan_open( canif_port *port, const char *name );
+void canif_pcan_close( canif_port *port );
+int canif_pcan_setup( canif_port *port, u32 bitrate );
+u32 canif_pcan_write( canif_port *port, const canif_msg *msgs, u32 count );
+u32 canif_pcan_read( canif_port *port, canif_msg *msgs, u32 maxcount, u32 timeout );
+#endif
+
+#endif
@@ -0,0 +1,105 @@
+// CAN interface implementation for the PEAK System PCAN-USB driver (libpcan)
+
+#ifdef PCAN_BUILD
+
+#include "canif.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <libpcan.h>
+
+// Helper function: get the BTR0BTR1 code from the actual bit rate
+static WORD canif_pcan_bitrate_to_btr( u32 bitrate )
+{
+  switch( bitrate )
+  {
+    case 500000: return CAN_BAUD_500K;
+    case 250000: return CAN_BAUD_250K;
+    case 125000: return CAN_BAUD_125K;
+  }
+  return CAN_BAUD_1M;
+}
+
+// Helper function: convert a received PEAK message
+static void canif_pcan_from_msg( canif_port *port, canif_msg *dst, const TPCANMsg *msg )
+{
+  DWORD status;
+
+  dst->id = msg->ID;
+  dst->len = msg->LEN > CANIF_MAX_DLEN ? CANIF_MAX_DLEN : msg->LEN;
+  dst->flags = 0;
+  memcpy( dst->data, msg->DATA, dst->len );
+
+  // The PEAK manual says that on errors a STATUS packet is inserted in the
+  // receive queue with the error code in DATA[3]. Only then the (costly)
+  // status ioctl is worth a call.
+  if( msg->MSGTYPE & MSGTYPE_STATUS )
+  {
+    dst->flags = CANIF_MSG_STATUS;
+    fprintf( stderr, "CAN status message received, error code %x\n", msg->DATA[ 3 ] );
+    // 0x0 means all right, 0x20 means receive queue empty, which is all right too
+    status = CAN_Status( port->pcan );
+    if( status != CAN_ERR_OK && status != CAN_ERR_QRCVEMPTY )
+      fprintf( stderr, "CAN status error, status: %x\n", ( unsigned )status );
+  }
+}
+
+int canif_pcan_open( canif_port *port, const char *name )
+{
+  if( ( port->pcan = LINUX_CAN_Open( name, O_RDWR ) ) == NULL )
+  {
+    fprintf( stderr, "canif_pcan_open: Peak CAN driver open fail\n" );
+    return CANIF_ERR;
+  }
+  return CANIF_OK;
+}
+
+void canif_pcan_close( canif_port *port )
+{
+  CAN_Close( port->pcan );
+}
+
+int canif_pcan_setup( canif_port *port, u32 bitrate )
+{
+  return CAN_Init( port->pcan, canif_pcan_bitrate_to_btr( bitrate ), CAN_INIT_TYPE_ST ) == CAN_ERR_OK ? CANIF_OK : CANIF_ERR;
+}
+
+// The PEAK driver has no batched write, frames go out one ioctl at a time
+u32 canif_pcan_write( canif_port *port, const canif_msg *msgs, u32 count )
+{
+  TPCANMsg msg;
+  u32 i;
+
+  for( i = 0; i < count; i ++ )
+  {
+    if( msgs[ i ].len > CANIF_MAX_DLEN )
+      break;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.ID = msgs[ i ].id;
+    msg.LEN = msgs[ i ].len;
+    msg.MSGTYPE = MSGTYPE_STANDARD;
+    memcpy( msg.DATA, msgs[ i ].data, msgs[ i ].len );
+    // Write blocks until a tx queue slot is found empty or an error occurred
+    if( CAN_Write( port->pcan, &msg ) != CAN_ERR_OK )
+      break;
+  }
+  return i;
+}
+
+// Wait for the first frame, then drain the driver queue without waiting
+u32 canif_pcan_read( canif_port *port, canif_msg *msgs, u32 maxcount, u32 timeout )
+{
+  TPCANRdMsg msgt;
+  u32 count = 0;
+
+  if( maxcount == 0 )
+    return 0;
+  if( LINUX_CAN_Read_Timeout( port->pcan, &msgt, timeout == CANIF_INF_TIMEOUT ? -1 : ( int )timeout ) != CAN_ERR_OK )
+    return 0;
+  canif_pcan_from_msg( port, &msgs[ count ++ ], &msgt.Msg );
+  while( count < maxcount && LINUX_CAN_Read_Timeout( port->pcan, &msgt, 0 ) == CAN_ERR_OK )
+    canif_pcan_from_msg( port, &msgs[ count ++ ], &msgt.Msg );
+  return count;
+}
+
+#endif // #ifdef PCAN_BUILD
@@ -0,0 +1,184 @@
+// CAN interface implementation for Linux SocketCAN (can0, vcan0 ...)
+
+#define _GNU_SOURCE
+#include "canif.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/can/error.h>
+
+// Frames moved by a single sendmmsg/recvmmsg call
+#define CANIF_SOCKETCAN_BATCH   64
+
+// Open the raw socket and bind it to the interface
+int canif_socketcan_open( canif_port *port, const char *name )
+{
+  struct sockaddr_can addr;
+  struct ifreq ifr;
+  can_err_mask_t errmask = CAN_ERR_MASK;
+  int fd;
+
+  if( ( fd = socket( PF_CAN, SOCK_RAW, CAN_RAW ) ) == -1 )
+  {
+    perror( "canif_socketcan_open: unable to create socket" );
+    return CANIF_ERR;
+  }
+
+  memset( &ifr, 0, sizeof( ifr ) );
+  strncpy( ifr.ifr_name, name, IFNAMSIZ - 1 );
+  if( ioctl( fd, SIOCGIFINDEX, &ifr ) == -1 )
+  {
+    perror( "canif_socketcan_open: unknown interface" );
+    close( fd );
+    return CANIF_ERR;
+  }
+
+  // Error frames are reported like the PEAK status messages
+  setsockopt( fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &errmask, sizeof( errmask ) );
+
+  memset( &addr, 0, sizeof( addr ) );
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if( bind( fd, ( struct sockaddr* )&addr, sizeof( addr ) ) == -1 )
+  {
+    perror( "canif_socketcan_open: unable to bind socket" );
+    close( fd );
+    return CANIF_ERR;
+  }
+
+  port->fd = fd;
+  return CANIF_OK;
+}
+
+// Close the socket
+void canif_socketcan_close( canif_port *port )
+{
+  close( port->fd );
+}
+
+// The bit rate of a SocketCAN interface belongs to the interface itself
+// (ip link set can0 type can bitrate 1000000), nothing to do here
+int canif_socketcan_setup( canif_port *port, u32 bitrate )
+{
+  ( void )port;
+  ( void )bitrate;
+  return CANIF_OK;
+}
+
+// Accept and send CAN FD frames on this socket
+int canif_socketcan_enable_fd( canif_port *port )
+{
+  int enable = 1;
+
+  if( setsockopt( port->fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof( enable ) ) == -1 )
+  {
+    perror( "canif_socketcan_enable_fd: interface does not support CAN FD" );
+    return CANIF_ERR;
+  }
+  return CANIF_OK;
+}
+
+// Write frames in batches, one sendmmsg per batch
+// Classic and FD frames share the canfd_frame layout, only the MTU differs
+u32 canif_socketcan_write( canif_port *port, const canif_msg *msgs, u32 count )
+{
+  struct canfd_frame frames[ CANIF_SOCKETCAN_BATCH ];
+  struct iovec iov[ CANIF_SOCKETCAN_BATCH ];
+  struct mmsghdr hdrs[ CANIF_SOCKETCAN_BATCH ];
+  struct pollfd pfd;
+  u32 sent = 0, batch, i;
+  int res;
+
+  while( sent < count )
+  {
+    batch = count - sent > CANIF_SOCKETCAN_BATCH ? CANIF_SOCKETCAN_BATCH : count - sent;
+    memset( hdrs, 0, batch * sizeof( struct mmsghdr ) );
+    for( i = 0; i < batch; i ++ )
+    {
+      memset( &frames[ i ], 0, sizeof( struct canfd_frame ) );
+      frames[ i ].can_id = msgs[ sent + i ].id & CAN_SFF_MASK;
+      frames[ i ].len = msgs[ sent + i ].len;
+      memcpy( frames[ i ].data, msgs[ sent + i ].data, msgs[ sent + i ].len );
+      iov[ i ].iov_base = &frames[ i ];
+      if( msgs[ sent + i ].flags & CANIF_MSG_FD )
+      {
+        frames[ i ].flags = ( msgs[ sent + i ].flags & CANIF_MSG_BRS ) ? CANFD_BRS : 0;
+        iov[ i ].iov_len = CANFD_MTU;
+      }
+      else
+        iov[ i ].iov_len = CAN_MTU;
+      hdrs[ i ].msg_hdr.msg_iov = &iov[ i ];
+      hdrs[ i ].msg_hdr.msg_iovlen = 1;
+    }
+
+    res = sendmmsg( port->fd, hdrs, batch, 0 );
+    if( res > 0 )
+      sent += res;
+    else if( res == -1 && ( errno == ENOBUFS || errno == EAGAIN ) )
+    {
+      // TX queue full: wait for room instead of spinning
+      pfd.fd = port->fd;
+      pfd.events = POLLOUT;
+      poll( &pfd, 1, 10 );
+    }
+    else if( res == -1 && errno != EINTR )
+      break;
+  }
+  return sent;
+}
+
+// Wait for the first frame, then collect everything already queued with one recvmmsg
+u32 canif_socketcan_read( canif_port *port, canif_msg *msgs, u32 maxcount, u32 timeout )
+{
+  struct canfd_frame frames[ CANIF_SOCKETCAN_BATCH ];
+  struct iovec iov[ CANIF_SOCKETCAN_BATCH ];
+  struct mmsghdr hdrs[ CANIF_SOCKETCAN_BATCH ];
+  struct pollfd pfd;
+  int res, i;
+
+  if( maxcount > CANIF_SOCKETCAN_BATCH )
+    maxcount = CANIF_SOCKETCAN_BATCH;
+
+  pfd.fd = port->fd;
+  pfd.events = POLLIN;
+  do
+    res = poll( &pfd, 1, timeout == CANIF_INF_TIMEOUT ? -1 : ( int )( timeout / 1000 ) );
+  while( res == -1 && errno == EINTR );
+  if( res <= 0 )
+    return 0;
+
+  memset( hdrs, 0, maxcount * sizeof( struct mmsghdr ) );
+  for( i = 0; i < ( int )maxcount; i ++ )
+  {
+    iov[ i ].iov_base = &frames[ i ];
+    iov[ i ].iov_len = CANFD_MTU;
+    hdrs[ i ].msg_hdr.msg_iov = &iov[ i ];
+    hdrs[ i ].msg_hdr.msg_iovlen = 1;
+  }
+  if( ( res = recvmmsg( port->fd, hdrs, maxcount, MSG_DONTWAIT, NULL ) ) <= 0 )
+    return 0;
+
+  for( i = 0; i < res; i ++ )
+  {
+    msgs[ i ].id = frames[ i ].can_id & CAN_EFF_MASK;
+    msgs[ i ].flags = ( frames[ i ].can_id & CAN_ERR_FLAG ) ? CANIF_MSG_STATUS : 0;
+    if( hdrs[ i ].msg_len == CANFD_MTU )
+    {
+      msgs[ i ].flags |= CANIF_MSG_FD;
+      if( frames[ i ].flags & CANFD_BRS )
+        msgs[ i ].flags |= CANIF_MSG_BRS;
+      msgs[ i ].len = frames[ i ].len > CANIF_FD_MAX_DLEN ? CANIF_FD_MAX_DLEN : frames[ i ].len;
+    }
+    else
+      msgs[ i ].len = frames[ i ].len > CANIF_MAX_DLEN ? CANIF_MAX_DLEN : frames[ i ].len;
+    memcpy( msgs[ i ].data, frames[ i ].data, msgs[ i ].len );
+  }
+  return ( u32 )res;
+}
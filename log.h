@@ -0,0 +1,29 @@
+// STM32 loader diagnostics
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdio.h>
+
+// Log levels, each one includes the previous ones
+#define STM32_LOG_QUIET     0 // results only
+#define STM32_LOG_PROGRESS  1 // workflow steps, progress and throughput reports
+#define STM32_LOG_PROTOCOL  2 // every command, ACK and block
+#define STM32_LOG_TRACE     3 // packet contents and byte counts
+
+// Highest level compiled in (-DSTM32_LOG_MAX=...), levels above it cost nothing
+#ifndef STM32_LOG_MAX
+#define STM32_LOG_MAX       STM32_LOG_TRACE
+#endif
+
+// Run time level, STM32_LOG_PROGRESS by default
+extern int stm32_log_level;
+
+// Log to stdout. Errors keep going to stderr with fprintf
+#define STM32_LOG( level, ... )\
+  do {\
+    if( ( level ) <= STM32_LOG_MAX && ( level ) <= stm32_log_level )\
+      printf( __VA_ARGS__ );\
+  } while( 0 )
+
+#endif
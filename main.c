@@ -1,55 +1,612 @@
 // Loader driver
 
 /*
- * Uses PEAK System PCAN-USB IPEH-002021 and its library
+ * Uses PEAK System PCAN-USB IPEH-002021 and its library,
+ * or any SocketCAN interface (can0, vcan0 ...)
  */
 
 
 #include "stm32ld.h"
+#include "stm32eng.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 static FILE *fp;
 static FILE *fflash;
 static u32 fpsize;
 static u32 fflashsize;
+static const u8 *image; //firmware image, mapped or loaded once and shared read-only by all the sessions
+
+// Session settings from the command line
+static int devselection;
+static u32 custombaseaddress;
+static int canfdselection;
+static int wantwrite = 0;  //not writing unless specified
+static int wantread = 0;   //not reading unless specified
+static int wanterase = 1;  //erasing unless specified not to do so
+static u8 nodes[ STM32_CAN_MAX_NODES ]; //CAN nodes flashed together
+static int nnodes = 0;
+static int wantengine = 0; //drive all the ports from one thread
+static int wantsparse = 0; //skip erased (all 0xFF) blocks
+static int wantmasserase = 0; //erase the whole flash instead of the image pages
+static u32 erasefirst, erasecount; //pages covered by the image, 0 pages for a mass erase
+static int wantdiff = 0; //rewrite only the pages that changed
+static int wantpipeline = 0; //erase page N+1 while writing page N
+static int wantcaps = 0; //print the bootloader command list
+static u32 blocksize = 0; //write block size, 0 for the bootloader default
+static u32 window = 0; //write transactions in flight, 0 for one at a time
+static u32 baud = SER_BAUD; //USART rate, any rate the adapter takes
+static int wantreset = 0; //reset into the bootloader with DTR/RTS before connecting
+static int wantlowlatency = 0; //USB-serial low latency settings, with round trips measured before and after
+static int wantbaudramp = 0; //go up to the fastest rate the link takes after connecting
+static char baudcachefile[ PATH_MAX ]; //rate found for each port and chip ID
+static pthread_mutex_t baudcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int wantresume = 0; //go on from where an interrupted write stopped
+static int wantverify = 0; //read the image range back and compare it with the image
+static int wantrepair = 0; //rewrite the pages that do not match instead of failing
+static const char *writefile; //firmware image file
+static char journalfile[ PATH_MAX ]; //confirmed write progress, next to the image file
+static u32 imagecrc;
+static const char *diffcachefile; //last image flashed, NULL to compare against a read-back
+static u8 *diffcache;
+static u32 diffcachesize;
 
 #define BL_VERSION_MAJOR  2
 #define BL_VERSION_MINOR  1
-#define BL_MKVER( major, minor )    ( ( major ) * 256 + ( minor ) ) 
+#define BL_MKVER( major, minor )    ( ( major ) * 256 + ( minor ) )
 #define BL_MINVERSION               BL_MKVER( BL_VERSION_MAJOR, BL_VERSION_MINOR )
 
 #define CHIP_ID           0x0414
 
+#define MAX_PORTS         256
+
+// One device being flashed
+typedef struct
+{
+  const char *portname;
+  stm32_session s;
+  u32 offset;             //next image byte to be written
+  unsigned expected_next; //next progress report (%)
+  const char *failed;     //failed step, NULL on success
+  double secs;
+} loader_job;
+
 
 // ****************************************************************************
 // Helper functions and macros
 
 // Get data function
-static u32 writeh_read_data( u8 *dst, u32 len )
+static u32 writeh_read_data( void *arg, u8 *dst, u32 len )
 {
-  size_t readbytes = 0;
+  loader_job *job = ( loader_job* )arg;
 
-  if( !feof( fp ) )
-    readbytes = fread( dst, 1, len, fp );
-  return ( u32 )readbytes;
+  if( len > fpsize - job->offset )
+    len = fpsize - job->offset;
+  memcpy( dst, image + job->offset, len );
+  job->offset += len;
+  return len;
 }
 
 // Progress function
-static void writeh_progress( u32 wrote )
+static void writeh_progress( void *arg, u32 wrote )
 {
+  loader_job *job = ( loader_job* )arg;
   unsigned pwrite = ( wrote * 100 ) / fpsize;
-  static int expected_next = 10;
 
-  if( pwrite >= expected_next )
+  if( pwrite >= job->expected_next )
+  {
+    STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: %s progress %d%% ", job->portname, job->expected_next);
+    job->expected_next += 10;
+    fflush( stdout );
+  }
+}
+
+// Load the firmware image, exit on failure. A regular file is mapped
+// read-only, all the sessions read straight from the page cache. Standard
+// input ("-") and pipes are read into memory as the data comes in.
+static void loader_load_image( const char *path )
+{
+  struct stat st;
+  int fd;
+  u32 room = 0;
+  ssize_t res;
+  u8 *buf = NULL, *grown;
+
+  fd = strcmp( path, "-" ) == 0 ? STDIN_FILENO : open( path, O_RDONLY );
+  if( fd == -1 || fstat( fd, &st ) == -1 )
+  {
+    fprintf( stderr, "Unable to open %s file\n", path );
+    exit( 1 );
+  }
+  STM32_LOG( STM32_LOG_PROGRESS, "host: firmware file %s opened successfully\n", path );
+  fpsize = 0;
+  if( S_ISREG( st.st_mode ) && st.st_size > 0 )
+  {
+    fpsize = st.st_size;
+    if( ( image = ( const u8* )mmap( NULL, fpsize, PROT_READ, MAP_PRIVATE, fd, 0 ) ) == MAP_FAILED )
+    {
+      fprintf( stderr, "Unable to map %s\n", path );
+      exit( 1 );
+    }
+    madvise( ( void* )image, fpsize, MADV_WILLNEED );
+  }
+  else
+  {
+    // Streaming: the buffer doubles when full
+    do
+    {
+      if( fpsize == room )
+      {
+        room = room ? room * 2 : 64 * 1024;
+        if( ( grown = ( u8* )realloc( buf, room ) ) == NULL )
+        {
+          fprintf( stderr, "Unable to load %s\n", path );
+          exit( 1 );
+        }
+        buf = grown;
+      }
+      if( ( res = read( fd, buf + fpsize, room - fpsize ) ) > 0 )
+        fpsize += res;
+    } while( res > 0 || ( res == -1 && errno == EINTR ) );
+    if( res == -1 )
+    {
+      fprintf( stderr, "Unable to load %s\n", path );
+      exit( 1 );
+    }
+    image = buf;
+  }
+  if( fd != STDIN_FILENO )
+    close( fd );
+  if( fpsize == 0 )
+  {
+    fprintf( stderr, "%s is empty\n", path );
+    exit( 1 );
+  }
+  STM32_LOG( STM32_LOG_PROGRESS, "host: %lu byte image %s\n", fpsize, buf ? "read" : "mapped" );
+}
+
+// Elapsed seconds since start
+static double loader_elapsed( const struct timeval *start )
+{
+  struct timeval now;
+
+  gettimeofday( &now, NULL );
+  return ( now.tv_sec - start->tv_sec ) + ( now.tv_usec - start->tv_usec ) / 1000000.0;
+}
+
+// Check the end of the region the journal says is written and return the
+// image offset to go on from, 0 to start over. Writing goes on from the
+// start of the page the run stopped in, that page is erased again.
+static u32 loader_resume( stm32_session *s, u32 confirmed )
+{
+  u8 device[ STM32_FLASH_PAGES_SIZE ];
+  u32 resume, from;
+  int ok;
+
+  resume = STM32_FLASH_BASE + ( ( s->baseaddress + confirmed - STM32_FLASH_BASE ) / STM32_FLASH_PAGES_SIZE ) * STM32_FLASH_PAGES_SIZE;
+  if( resume <= s->baseaddress )
+    return 0;
+  resume -= s->baseaddress;
+
+  // The whole region when the bootloader computes CRCs, its last page otherwise
+  if( stm32_has_cap( s, STM32_CMD_CRC ) )
+    ok = stm32_verify_crc( s, s->baseaddress, image, resume ) == STM32_OK;
+  else
+  {
+    from = resume > STM32_FLASH_PAGES_SIZE ? resume - STM32_FLASH_PAGES_SIZE : 0;
+    ok = stm32_read_memory( s, s->baseaddress + from, device, resume - from ) == STM32_OK &&
+        memcmp( device, image + from, resume - from ) == 0;
+  }
+  if( !ok )
+  {
+    fprintf( stderr, "host: FLASH contents do not match the journal, starting over\n" );
+    return 0;
+  }
+  STM32_LOG( STM32_LOG_PROGRESS, "host: resuming at byte %lu of %lu (%lu confirmed)\n", resume, fpsize, confirmed );
+  return resume;
+}
+
+// Rate found for the port and chip ID by an earlier -baud auto run, 0 if none
+static u32 loader_baud_cached( const char *portname, u16 chip_id )
+{
+  char port[ PATH_MAX ];
+  unsigned id;
+  u32 rate, found = 0;
+  FILE *f;
+
+  pthread_mutex_lock( &baudcache_lock );
+  if( ( f = fopen( baudcachefile, "r" ) ) != NULL )
+  {
+    while( fscanf( f, "%4095s %x %lu", port, &id, &rate ) == 3 )
+      if( strcmp( port, portname ) == 0 && id == chip_id )
+        found = rate;
+    fclose( f );
+  }
+  pthread_mutex_unlock( &baudcache_lock );
+  return found;
+}
+
+// Record the rate found for the port and chip ID, one line per port and
+// chip ID: the file is copied without the old line and renamed over
+static void loader_baud_store( const char *portname, u16 chip_id, u32 baud )
+{
+  char port[ PATH_MAX ], tmpname[ PATH_MAX + 4 ];
+  unsigned id;
+  u32 rate;
+  FILE *f, *tmp;
+
+  pthread_mutex_lock( &baudcache_lock );
+  snprintf( tmpname, sizeof( tmpname ), "%s.tmp", baudcachefile );
+  if( ( tmp = fopen( tmpname, "w" ) ) != NULL )
+  {
+    if( ( f = fopen( baudcachefile, "r" ) ) != NULL )
+    {
+      while( fscanf( f, "%4095s %x %lu", port, &id, &rate ) == 3 )
+        if( strcmp( port, portname ) != 0 || id != chip_id )
+          fprintf( tmp, "%s %04X %lu\n", port, id, rate );
+      fclose( f );
+    }
+    fprintf( tmp, "%s %04X %lu\n", portname, chip_id, baud );
+    if( fclose( tmp ) != 0 || rename( tmpname, baudcachefile ) != 0 )
+      fprintf( stderr, "host: cannot update %s\n", baudcachefile );
+  }
+  else
+    fprintf( stderr, "host: cannot update %s\n", baudcachefile );
+  pthread_mutex_unlock( &baudcache_lock );
+}
+
+// Whole loader workflow on one device, returns 0 on success
+// On failure job->failed names the step that failed
+static int loader_run( loader_job *job )
+{
+  stm32_session *s = &job->s;
+  u8 minor, major;
+  u16 version;
+  int node;
+  struct timeval start;
+  u32 first = erasefirst, count = erasecount;
+  u32 confirmed, resume = 0, crc, cached;
+  int res;
+
+  gettimeofday( &start, NULL );
+  job->failed = NULL;
+  job->offset = 0;
+  job->expected_next = 10;
+  stm32_session_init( s, devselection, custombaseaddress );
+  s->canfdselection = canfdselection;
+  s->sparse = wantsparse;
+  s->pipeline = wantpipeline;
+  s->imagesize = fpsize;
+  s->blocksize = blocksize;
+  s->window = window;
+  s->reset = wantreset;
+  s->user = job;
+  if (nnodes)
+    stm32_CAN_set_nodes( s, nodes, nnodes );
+
+  // Connect to bootloader
+  STM32_LOG( STM32_LOG_PROGRESS, "host: Initializing communication with the device %s\n", job->portname);
+  if( stm32_init( s, job->portname, baud ) != STM32_OK )
+  {
+    fprintf( stderr, "host: Unable to connect to bootloader\n\n" );
+    job->failed = "connect";
+    goto done;
+  }
+  else
+    STM32_LOG( STM32_LOG_PROGRESS, "host: init succeded, bootloader ready in %.1f ms\n", loader_elapsed( &start ) * 1000 );
+
+
+  // Per node setup: in CAN multicast mode every node is prepared on its own ID
+  for( node = 0; node < ( nnodes ? nnodes : 1 ); node ++ )
+  {
+    if( nnodes )
+    {
+      stm32_CAN_select_node( s, node );
+      STM32_LOG( STM32_LOG_PROGRESS, "host: node %d\n", nodes[ node ] );
+    }
+
+    // Get version
+    if( stm32_get_version( s, &major, &minor ) != STM32_OK )
+    {
+      fprintf( stderr, "host: Unable to get bootloader version\n\n" );
+      job->failed = "get version";
+      goto done;
+    }
+    else
+    {
+      STM32_LOG( STM32_LOG_PROGRESS, "host: Found bootloader version: %d.%d\n", major, minor );
+      if( wantcaps )
+        stm32_dump_caps( s );
+      /*
+      if( BL_MKVER( major, minor ) < BL_MINVERSION )
+      {
+        fprintf( stderr, "\n:Unsupported bootloader version" );
+        exit( 1 );
+      }
+      */
+    }
+
+    // Get chip ID
+    if( stm32_get_chip_id( s, &version ) != STM32_OK )
+    {
+      fprintf( stderr, "host:Unable to get chip ID\n\n" );
+      job->failed = "get chip ID";
+      goto done;
+    }
+    else
+    {
+      STM32_LOG( STM32_LOG_PROGRESS, "host: Chip ID: %04X\n", version );
+      /*
+      if( version != CHIP_ID )
+      {
+        fprintf( stderr, "\nhost: Unsupported chip ID" );
+        exit( 1 );
+      }
+      */
+    }
+
+    // Round trips before and after the low latency settings
+    if (wantlowlatency) {
+      u32 before, after;
+      if( stm32_profile_rtt( s, "default", &before ) != STM32_OK )
+        fprintf( stderr, "host: no answer to the round trip probes\n" );
+      else if( stm32_low_latency( s ) == STM32_OK && stm32_profile_rtt( s, "low latency", &after ) == STM32_OK )
+        STM32_LOG( STM32_LOG_PROGRESS, "host: median round trip %.1fx shorter\n", after ? ( double )before / after : 0 );
+    }
+
+    // Faster rate: straight to the one found last time on this port and
+    // chip, or up the standard rates until a test burst fails
+    if (wantbaudramp) {
+      cached = loader_baud_cached( job->portname, version );
+      res = cached > s->baud ? stm32_try_baud( s, cached ) : STM32_COMM_ERROR;
+      if( res == STM32_COMM_ERROR )
+        res = stm32_ramp_baud( s, STM32_BAUD_MAX );
+      if( res != STM32_OK )
+      {
+        fprintf( stderr, "host: bootloader lost while changing the baud rate\n\n" );
+        job->failed = "baud";
+        goto done;
+      }
+      if( s->baud != cached )
+        loader_baud_store( job->portname, version, s->baud );
+      STM32_LOG( STM32_LOG_PROGRESS, "host: %s at %lu baud\n", job->portname, s->baud );
+    }
+
+    // Journal of the confirmed blocks, to go on from where an interrupted
+    // run stopped (the device was unprotected and erased by then)
+    if (wantresume) {
+      if( stm32_journal_open( s, journalfile, imagecrc, fpsize, version, &confirmed ) != STM32_OK )
+        fprintf( stderr, "host: cannot open %s, no journal kept\n", journalfile );
+      else if( confirmed > 0 && ( resume = loader_resume( s, confirmed ) ) > 0 )
+      {
+        // The journal may cover the whole image (a run stopped while
+        // checking it): nothing is erased or written, the image is checked
+        if( resume >= fpsize )
+          count = 0;
+        else if( stm32_flash_pages( s->baseaddress + resume, fpsize - resume, &first, &count ) != STM32_OK )
+        {
+          fprintf( stderr, "host: cannot erase from byte %lu on by pages, starting over\n", resume );
+          resume = 0;
+        }
+      }
+    }
+
+    // Write unprotect, only when something is protected: the device resets
+    // and must be connected again. Reading needs no unprotect.
+    if ((wantwrite || wantrepair) && !resume && !stm32_write_protected( s ))
+      STM32_LOG( STM32_LOG_PROGRESS, "host: FLASH not write protected.\n" );
+    else if ((wantwrite || wantrepair) && !resume) {
+      if( stm32_write_unprotect( s ) != STM32_OK )
+      {
+        fprintf( stderr, ":host: Unable to execute write unprotect\n\n" );
+        job->failed = "write unprotect";
+        goto done;
+      }
+      else
+        STM32_LOG( STM32_LOG_PROGRESS, "host: Cleared write protection.\n\n" );
+    }
+
+    // Erase flash (a differential write erases the changed pages only,
+    // a pipelined write erases every page just ahead of its blocks)
+    if (wantwrite && wanterase && wantpipeline && count && !wantdiff && !nnodes && stm32_has_cap( s, STM32_CMD_ERASE_ASYNC ))
+      STM32_LOG( STM32_LOG_PROGRESS, "host: FLASH pages will be erased while writing.\n" );
+    else if (wantwrite && wanterase && !wantdiff && resume < fpsize) {
+      // Only the pages under the image, unless the bootloader refuses the page list
+      // (a resumed write must keep the pages already written)
+      int erased = 0;
+      if( count )
+      {
+        if( stm32_erase_pages( s, first, count ) == STM32_OK )
+          erased = 1;
+        else if( !resume )
+          fprintf( stderr, "host: page erase failed, erasing the whole FLASH\n" );
+      }
+      if( erased )
+        STM32_LOG( STM32_LOG_PROGRESS, "host: Erased FLASH pages %lu to %lu.\n", first, first + count - 1 );
+      else if( resume || stm32_erase_flash( s ) != STM32_OK )
+      {
+        fprintf( stderr, "Unable to erase chip\n\n" );
+        job->failed = "erase";
+        goto done;
+      }
+      else
+        STM32_LOG( STM32_LOG_PROGRESS, "host: Erased FLASH memory.\n" );
+    }
+  }
+  if( nnodes )
+    stm32_CAN_select_node( s, STM32_CAN_ALL_NODES );
+
+  // Program flash
+  if (wantwrite && wantdiff) {
+    STM32_LOG( STM32_LOG_PROGRESS, "host: Programming the changed pages ... \n ");
+    if( stm32_write_diff( s, image, fpsize, diffcache, diffcachesize, writeh_progress ) != STM32_OK )
+    {
+      fprintf( stderr, "Unable to program FLASH memory.\n\n" );
+      job->failed = "write";
+      goto done;
+    }
+    STM32_LOG( STM32_LOG_PROGRESS, "\nhost: write memory successfully completed.\n" );
+    // The cache now holds what is on the device
+    if( diffcachefile && ( fp = fopen( diffcachefile, "wb" ) ) != NULL )
+    {
+      fwrite( image, 1, fpsize, fp );
+      fclose( fp );
+    }
+  }
+  else if (wantwrite && resume >= fpsize) {
+    // Only the last page was checked without the bootloader CRC, the rest
+    // is read back. On a mismatch the journal goes, the next run starts over.
+    STM32_LOG( STM32_LOG_PROGRESS, "host: the whole image is on the device already.\n" );
+    if( !stm32_has_cap( s, STM32_CMD_CRC ) &&
+        stm32_verify_flash( s, image, fpsize, wantrepair, &crc, writeh_progress ) != STM32_OK )
+    {
+      fprintf( stderr, "host: FLASH contents do not match the image\n\n" );
+      fclose( s->journal );
+      s->journal = NULL;
+      remove( journalfile );
+      job->failed = "verify";
+      goto done;
+    }
+  }
+  else if (wantwrite) {
+    STM32_LOG( STM32_LOG_PROGRESS, "host: Programming flash ... \n ");
+    s->resumeoffset = resume;
+    job->offset = resume;
+    job->expected_next = ( resume * 10 / fpsize ) * 10 + 10;
+    if( stm32_write_flash( s, writeh_read_data, writeh_progress ) != STM32_OK )
+    {
+      fprintf( stderr, "Unable to program FLASH memory.\n\n" );
+      job->failed = "write";
+      goto done;
+    }
+    else
+      STM32_LOG( STM32_LOG_PROGRESS, "\nhost: write memory successfully completed.\n" );
+  }
+
+  // Check the image against the bootloader CRC, when it computes one
+  if (wantwrite && stm32_has_cap( s, STM32_CMD_CRC )) {
+    for( node = 0; node < ( nnodes ? nnodes : 1 ); node ++ )
+    {
+      if( nnodes )
+        stm32_CAN_select_node( s, node );
+      if( stm32_verify_crc( s, s->baseaddress, image, fpsize ) != STM32_OK )
+      {
+        fprintf( stderr, "host: FLASH contents do not match the image\n\n" );
+        job->failed = "verify";
+        goto done;
+      }
+    }
+    if( nnodes )
+      stm32_CAN_select_node( s, STM32_CAN_ALL_NODES );
+    STM32_LOG( STM32_LOG_PROGRESS, "host: image CRC verified.\n" );
+  }
+
+  // Read back and compare, rewriting the mismatched pages with -repair
+  if (wantverify) {
+    for( node = 0; node < ( nnodes ? nnodes : 1 ); node ++ )
+    {
+      if( nnodes )
+        stm32_CAN_select_node( s, node );
+      STM32_LOG( STM32_LOG_PROGRESS, "host: Verifying flash ... \n");
+      job->expected_next = 10;
+      if( ( res = stm32_verify_flash( s, image, fpsize, wantrepair, &crc, writeh_progress ) ) != STM32_OK )
+      {
+        fprintf( stderr, res == STM32_VERIFY_ERROR ? "host: FLASH contents do not match the image\n\n" : "Unable to read FLASH memory.\n\n" );
+        job->failed = "verify";
+        goto done;
+      }
+      STM32_LOG( STM32_LOG_PROGRESS, "\nhost: FLASH matches the image, CRC-32 %08lX.\n", crc );
+    }
+    if( nnodes )
+      stm32_CAN_select_node( s, STM32_CAN_ALL_NODES );
+  }
+
+  // The image is written, the journal is not needed any more
+  if (wantwrite && s->journal) {
+    fclose( s->journal );
+    s->journal = NULL;
+    remove( journalfile );
+  }
+
+  // Read flash
+  if (wantread) {
+    STM32_LOG( STM32_LOG_PROGRESS, "host: Reading flash ... \n");
+    if( stm32_read_flash( s, fflash ) != STM32_OK )
+    {
+      fprintf( stderr, "Unable to read FLASH memory.\n\n" );
+      job->failed = "read";
+      goto done;
+    }
+    else {
+      fseek( fflash, 0, SEEK_END );
+      fflashsize = ftell( fflash );
+      fseek( fflash, 0, SEEK_SET );
+      STM32_LOG( STM32_LOG_PROGRESS, "\nhost: FLASH memory successfully read (%lu bytes).\n",fflashsize);
+    }
+  }
+
+  // Jump to app
+  STM32_LOG( STM32_LOG_PROGRESS, "host: Jumping to app...\n");
+  for( node = 0; node < ( nnodes ? nnodes : 1 ); node ++ )
   {
-    printf( "\n\thost: progress %d%% ", expected_next);
-    expected_next += 10;
+    if( nnodes )
+      stm32_CAN_select_node( s, node );
+    stm32_jump( s );
   }
+
+done:
+  stm32_close( s );
+  job->secs = loader_elapsed( &start );
+  return job->failed ? 1 : 0;
+}
+
+// Thread body for -ports
+static void* loader_thread( void *arg )
+{
+  loader_run( ( loader_job* )arg );
+  return NULL;
+}
+
+// Run the workflow on all the ports from this thread (-engine)
+static int loader_run_engine( loader_job *jobs, int njobs )
+{
+  static stm32eng_dev devs[ MAX_PORTS ];
+  stm32eng_job job;
+  int i, nfailed;
+
+  memset( &job, 0, sizeof( job ) );
+  job.image = wantwrite ? image : NULL;
+  job.imagesize = fpsize;
+  job.baseaddress = custombaseaddress;
+  job.baud = baud;
+  job.unprotect = wantwrite;
+  job.erase = wanterase;
+  job.sparse = wantsparse;
+  job.erasefirst = erasefirst;
+  job.erasecount = erasecount;
+  job.go = 1;
+  for( i = 0; i < njobs; i ++ )
+  {
+    memset( &devs[ i ], 0, sizeof( stm32eng_dev ) );
+    devs[ i ].portname = jobs[ i ].portname;
+  }
+
+  nfailed = stm32eng_run( &job, devs, njobs );
+  for( i = 0; i < njobs; i ++ )
+  {
+    jobs[ i ].secs = devs[ i ].secs;
+    jobs[ i ].failed = devs[ i ].state == STM32ENG_DONE ? NULL : stm32eng_state_name( devs[ i ].failed_state );
+  }
+  return nfailed;
 }
 
 // ****************************************************************************
@@ -57,20 +614,32 @@ static void writeh_progress( u32 wrote )
 
 int main( int argc, const char **argv )
 {
-  u8 minor, major;
-  u16 version;
-  int wantwrite = 0;  //not writing unless specified
-  int wantread = 0;   //not reading unless specified
-  int wanterase = 1;  //erasing unless specified not to do so
   int argind = 0;
- 
-  printf("\n==========================");
-  printf("\n  CBBL host side loader   ");
-  printf("\n--------------------------");
-  printf("\nZavatta Marco, Yin Zhining");
-  printf("\nPolimi  2011/2012");
-  printf("\n==========================");
-  printf("\n");
+  char *nodelist;
+  char *portlist = NULL, *port;
+  static loader_job jobs[ MAX_PORTS ];
+  pthread_t threads[ MAX_PORTS ];
+  int started[ MAX_PORTS ];
+  int njobs = 0, nfailed = 0, i;
+  double slowest = 0;
+  struct timeval start;
+
+  // Log level first, it applies to everything below
+  for( i = 1; i < argc; i ++ )
+  {
+    if( strcmp( argv[ i ], "-quiet" ) == 0 )
+      stm32_log_level = STM32_LOG_QUIET;
+    else if( strcmp( argv[ i ], "-loglevel" ) == 0 && i + 1 < argc )
+      stm32_log_level = atoi( argv[ i + 1 ] );
+  }
+
+  STM32_LOG( STM32_LOG_PROGRESS, "\n==========================");
+  STM32_LOG( STM32_LOG_PROGRESS, "\n  CBBL host side loader   ");
+  STM32_LOG( STM32_LOG_PROGRESS, "\n--------------------------");
+  STM32_LOG( STM32_LOG_PROGRESS, "\nZavatta Marco, Yin Zhining");
+  STM32_LOG( STM32_LOG_PROGRESS, "\nPolimi  2011/2012");
+  STM32_LOG( STM32_LOG_PROGRESS, "\n==========================");
+  STM32_LOG( STM32_LOG_PROGRESS, "\n");
 
   /*
   printf("Number of arguments argc = %d \n",argc);
@@ -87,23 +656,57 @@ int main( int argc, const char **argv )
   // Help argument handler
   if (strcmp(argv[1],"-help")==0)
   {
-	fprintf( stderr, "Program usage:./stm32ld_cbbl {-usart,-can} {device path e.g. /dev/ttyUSB0}"
-			" [-write, firmware file] [-read, download file] [-noerase] {-defaultbaseaddr,(-custombaseaddr, value)}\n"
+	fprintf( stderr, "Program usage:./stm32ld_cbbl {-usart,-can} {device path e.g. /dev/ttyUSB0, or -ports path1,path2,...}"
+			" [-write, firmware file] [-read, download file] [-noerase] [-masserase] [-pipeline] [-sparse] [-diff] [-diffcache, file] [-canfd] [-caps] [-blocksize, n] [-window, n|auto] [-baud, n|auto] [-baudcache, file] [-lowlatency] [-reset] [-resume] [-verify, (file)] [-repair] [-nodes, n1,n2,...] [-quiet] [-loglevel, n] {-defaultbaseaddr,(-custombaseaddr, value)}\n"
 			"arguments marked with {} are mandatory unless going for -help\n"
 			"arguments marked with [] are optional\n"
 			"order of the first two arguments should be respected\n"
 			"examples:\n"
 			"stm32ld_cbbl -usart /dev/ttyUSB0 -write firmwaretowrite.bin -defaultbaseaddr\n"
 			"stm32ld_cbbl -can /dev/pcanusb0 -custombaseaddr 0x08007000 -read readflashmemory.bin -write firmwaretowrite.bin\n"
+			"stm32ld_cbbl -can can0 -write firmwaretowrite.bin -defaultbaseaddr (SocketCAN interface)\n"
+			"stm32ld_cbbl -can can0 -nodes 1,2,3,4 -write firmwaretowrite.bin -defaultbaseaddr\n"
+			"stm32ld_cbbl -usart -ports /dev/ttyUSB0,/dev/ttyUSB1 -write firmwaretowrite.bin -defaultbaseaddr\n"
 			"switches description:\n"
-			"-write	write specified file into Flash memory from given address\n"
+			"-write	write specified file into Flash memory from given address,\n"
+			"\t- for standard input\n"
 			"-read	read Flash memory into specified file from given address\n"
 		    " neither -write nor -read	jump to specified memory address and execute\n"
 			"-defaultbaseaddr use hard-coded base address 0x0800 6000 as the first\n"
 		    "\tFlash address where the write/read/jump operations will begin\n"
 			"-custombaseaddr use the specified value as the base address\n"
-		    "\tvalue must be in the format 0xY\n"
-		    "-noerase do not erase the Flash memory"
+		    "\tvalue must be in the format 0xY, on a 1024 byte page boundary unless\n"
+		    "\t-masserase or -noerase is given\n"
+		    "-noerase do not erase the Flash memory\n"
+		    "-sparse do not send the blocks that are all 0xFF (already erased)\n"
+		    "-masserase erase the whole Flash memory, not only the pages under the image\n"
+		    "-pipeline erase each page while the previous one is written, when the\n"
+		    "\tbootloader supports it (whole image erase up front otherwise)\n"
+		    "-diff erase and write only the pages that differ from the device contents\n"
+		    "-diffcache file compare with the last image flashed (kept in file) instead\n"
+		    "\tof reading the device back\n"
+		    "-ports flash one device on each of the given ports at the same time\n"
+		    "\t(up to 256 ports, cannot be used with -read)\n"
+		    "-engine with -usart -ports, drive all the ports from a single thread\n"
+		    "-caps print the commands the bootloader supports\n"
+		    "-blocksize n bytes per write transaction, up to 2048 (default one 1024 byte\n"
+		    "\tpage if the bootloader has the extended write, 256 otherwise)\n"
+		    "-window n keep up to n (max 8) write transactions in flight when the\n"
+		    "\tbootloader supports it, auto sizes the window from the round trip time\n"
+		    "-baud n USART rate (default 115200), standard rates up to 4000000 or any\n"
+		    "\trate the adapter takes; auto goes up from 115200 to the fastest rate that\n"
+		    "\tpasses a test burst, when the bootloader can switch, and remembers it\n"
+		    "-baudcache file rates found by -baud auto (default ~/.stm32ld_baud)\n"
+		    "-reset reset into the bootloader first, RTS driving BOOT0 and DTR driving NRST\n"
+		    "-lowlatency USB-serial low latency mode (ASYNC_LOW_LATENCY, 1 ms adapter\n"
+		    "\tlatency timer where permitted), round trips reported before and after\n"
+		    "-resume keep a journal of the written blocks (firmware file.journal) and\n"
+		    "\tgo on from where an interrupted write of the same image stopped\n"
+		    "-verify read back the image range and compare it with the image written,\n"
+		    "\tor with the given file without -write, stopping at the first mismatch\n"
+		    "-repair with -verify, rewrite the pages that do not match\n"
+		    "-quiet print results and errors only\n"
+		    "-loglevel n 0 quiet, 1 progress (default), 2 protocol, 3 packet trace"
 			"\n\n" );
 	exit( 1 );
 	}
@@ -123,11 +726,11 @@ int main( int argc, const char **argv )
 		  found = 1;
 		  if (strcmp(argv[argind],"-custombaseaddr") == 0) {
 		  	  custombaseaddress = strtoul( argv[argind+1], NULL, 0);
-		  	  printf("host: custom base address selected: %x\n", custombaseaddress);
+		  	  STM32_LOG( STM32_LOG_PROGRESS, "host: custom base address selected: %lx\n", custombaseaddress);
 		    }
 		    else if (strcmp(argv[argind],"-defaultbaseaddr") == 0) {
 		  	  custombaseaddress = STM32_FLASH_START_ADDRESS;
-		  	  printf("host: default base address selected: %x\n", custombaseaddress);
+		  	  STM32_LOG( STM32_LOG_PROGRESS, "host: default base address selected: %lx\n", custombaseaddress);
 		    }
 	  }
 	  argind++;
@@ -139,7 +742,7 @@ int main( int argc, const char **argv )
 
 
   /*
-  if( ( errno == ERANGE && ( baud == LONG_MAX || baud == LONG_MIN ) ) || ( errno != 0 && baud == 0 ) || ( baud < 0 ) ) 
+  if( ( errno == ERANGE && ( baud == LONG_MAX || baud == LONG_MIN ) ) || ( errno != 0 && baud == 0 ) || ( baud < 0 ) )
   {
     fprintf( stderr, "Invalid baud '%s'\n", argv[ 2 ] );
     exit( 1 );
@@ -155,25 +758,38 @@ int main( int argc, const char **argv )
 	  }
   	  argind++;
   }
-  // If yes, open firmware file to be written
+  // If yes, load the firmware file to be written
+  // (loaded once, every session writes from the same image)
   if (wantwrite) {
-	  printf("host: write selected\n");
-	  if( ( fp = fopen(argv[argind+1], "rb" ) ) == NULL )
-	  {
-		fprintf( stderr, "Unable to open ");
-		fprintf( stderr, argv[argind+1]);
-		fprintf( stderr, " file\n");
-		exit( 1 );
-	  }
-	  else
-	  {
-		printf("host: firmware file %s opened successfully\n", argv[argind+1]);
-		fseek( fp, 0, SEEK_END );
-		fpsize = ftell( fp );
-		fseek( fp, 0, SEEK_SET );
-	  }
+	  STM32_LOG( STM32_LOG_PROGRESS, "host: write selected\n");
+	  writefile = argv[argind+1];
+	  loader_load_image( writefile );
   }
-  
+
+  // Want to check the FLASH against the image? The image written, or the
+  // given file without -write
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-verify")==0) {
+		wantverify=1;
+		if (argind+1<argc && argv[argind+1][0] != '-') {
+			if (wantwrite)
+				fprintf( stderr, "host: -verify checks the image written, %s ignored\n", argv[argind+1] );
+			else
+				loader_load_image( argv[argind+1] );
+		}
+	 }
+	 else if (strcmp(argv[argind],"-repair")==0)
+		wantrepair=1;
+	  argind++;
+  }
+  if (wantverify && !image) {
+	  fprintf( stderr, "host: -verify needs -write or an image file\n\n" );
+	  exit(1);
+  }
+  if (wantverify)
+	  STM32_LOG( STM32_LOG_PROGRESS, "host: verify selected%s\n", wantrepair ? ", mismatched pages are rewritten" : "");
+
   // Want to read?
   argind=0;
   while (argind<argc) {
@@ -186,7 +802,7 @@ int main( int argc, const char **argv )
   // If yes, open destination file for data from memory
   // file will be created and opened in write mode if non existing (wb option)
   if (wantread) {
-	  printf("host: read selected\n");
+	  STM32_LOG( STM32_LOG_PROGRESS, "host: read selected\n");
 	  if( ( fflash = fopen(argv[argind+1], "wb" ) ) == NULL )
 	  {
 		fprintf( stderr, "Unable to open ");
@@ -196,7 +812,7 @@ int main( int argc, const char **argv )
 	  }
 	  else
 	  {
-		printf("host: flash memory download file %s opened successfully\n",argv[argind+1]);
+		STM32_LOG( STM32_LOG_PROGRESS, "host: flash memory download file %s opened successfully\n",argv[argind+1]);
 		fseek( fflash, 0, SEEK_END );
 		fflashsize = ftell( fflash );
 		fseek( fflash, 0, SEEK_SET );
@@ -213,120 +829,337 @@ int main( int argc, const char **argv )
       argind++;
   }
   if (wanterase)
-	  printf("host: erase selected\n");
-  else printf("host: erase deactivated\n");
+	  STM32_LOG( STM32_LOG_PROGRESS, "host: erase selected\n");
+  else STM32_LOG( STM32_LOG_PROGRESS, "host: erase deactivated\n");
 
+  // Want to skip the erased blocks?
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-sparse")==0) {
+		wantsparse=1;
+		break;
+	  }
+	  argind++;
+  }
+  if (wantsparse && !wanterase) {
+	  fprintf( stderr, "host: -sparse needs the flash to be erased, ignored with -noerase\n" );
+	  wantsparse=0;
+  }
+  else if (wantsparse)
+	  STM32_LOG( STM32_LOG_PROGRESS, "host: sparse write selected\n");
 
-  /******************************************** Loader workflow *************************************/
-  // Connect to bootloader
-  printf( "host: Initializing communication with the device\n");
-  if( stm32_init(argv[2], (u32)SER_BAUD ) != STM32_OK )
-  {
-    fprintf( stderr, "host: Unable to connect to bootloader\n\n" );
-    exit( 1 );
+  // Want to erase while writing?
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-pipeline")==0) {
+		wantpipeline=1;
+		break;
+	  }
+	  argind++;
+  }
+  if (wantpipeline && !wanterase) {
+	  fprintf( stderr, "host: -pipeline erases while writing, ignored with -noerase\n" );
+	  wantpipeline=0;
   }
-    else printf("host: init succeded\n");
 
+  // Print the bootloader command list?
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-caps")==0) {
+		wantcaps=1;
+		break;
+	  }
+	  argind++;
+  }
 
-  // Get version
-  if( stm32_get_version( &major, &minor ) != STM32_OK )
-  {
-    fprintf( stderr, "host: Unable to get bootloader version\n\n" );
-    exit( 1 );
+  // Erase only the pages the image covers, or everything?
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-masserase")==0) {
+		wantmasserase=1;
+		break;
+	  }
+	  argind++;
   }
-  else
-  {
-    printf( "host: Found bootloader version: %d.%d\n", major, minor );
-    /*
-    if( BL_MKVER( major, minor ) < BL_MINVERSION )
-    {
-      fprintf( stderr, "\n:Unsupported bootloader version" );
-      exit( 1 );
-    }
-    */
+  // Erasing a page also erases whatever is below the base address in it
+  if (wantwrite && wanterase && !wantmasserase && ( custombaseaddress - STM32_FLASH_BASE ) % STM32_FLASH_PAGES_SIZE) {
+	  fprintf( stderr, "host: page erase needs a base address on a %d byte page boundary, use -masserase or -noerase\n\n", STM32_FLASH_PAGES_SIZE );
+	  exit(1);
   }
-  
-  // Get chip ID
-  if( stm32_get_chip_id( &version ) != STM32_OK )
-  {
-    fprintf( stderr, "host:Unable to get chip ID\n\n" );
-    exit( 1 );
+  if (wantwrite && wanterase && !wantmasserase) {
+	  if (stm32_flash_pages( custombaseaddress, fpsize, &erasefirst, &erasecount ) == STM32_OK)
+		  STM32_LOG( STM32_LOG_PROGRESS, "host: image covers %lu pages from page %lu\n", erasecount, erasefirst);
+	  else {
+		  fprintf( stderr, "host: image does not fit the FLASH pages, erasing the whole FLASH\n" );
+		  erasecount = 0;
+	  }
   }
-  else
-  {
-    printf( "host: Chip ID: %04X\n", version );
-    /*
-    if( version != CHIP_ID )
-    {
-      fprintf( stderr, "\nhost: Unsupported chip ID" );
-      exit( 1 );
-    }
-    */
+
+  // Want CAN FD?
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-canfd")==0) {
+		canfdselection=1;
+		STM32_LOG( STM32_LOG_PROGRESS, "host: CAN FD bulk transfers requested\n");
+		break;
+	  }
+	  argind++;
   }
 
-  // Write unprotect
-  if (wantread || wantwrite) {
-	  if( stm32_write_unprotect() != STM32_OK )
-	  {
-		fprintf( stderr, ":host: Unable to execute write unprotect\n\n" );
-		exit( 1 );
+  // Want to flash several CAN nodes at once?
+  argind=0;
+  while (argind<argc-1) {
+	 if (strcmp(argv[argind],"-nodes")==0) {
+		nodelist = ( char* )argv[argind+1];
+		while (*nodelist && nnodes<STM32_CAN_MAX_NODES) {
+			nodes[nnodes++] = ( u8 )strtoul( nodelist, &nodelist, 0 );
+			if (*nodelist == ',') nodelist++;
+		}
+		break;
 	  }
-	  else
-		printf( "host: Cleared write protection.\n\n" );
+	  argind++;
+  }
+  if (nnodes) {
+	  if (devselection != CAN || wantread) {
+		  fprintf( stderr, "host: -nodes needs -can and cannot be used with -read\n\n" );
+		  exit(1);
+	  }
+	  STM32_LOG( STM32_LOG_PROGRESS, "host: multicast flashing of %d CAN nodes\n", nnodes);
   }
 
-  // Erase flash
-  if (wantwrite && wanterase) {
-	  if( stm32_erase_flash() != STM32_OK )
-	  {
-		fprintf( stderr, "Unable to erase chip\n\n" );
-		exit( 1 );
+  // Want to flash several ports at once?
+  argind=0;
+  while (argind<argc-1) {
+	 if (strcmp(argv[argind],"-ports")==0) {
+		portlist = strdup( argv[argind+1] );
+		break;
 	  }
-	  else
-		printf( "host: Erased FLASH memory.\n" );
+	  argind++;
+  }
+  if (portlist && wantread) {
+	  fprintf( stderr, "host: -ports cannot be used with -read\n\n" );
+	  exit(1);
   }
 
-  // Program flash
-  if (wantwrite) {
-	  setbuf( stdout, NULL );
-	  printf( "host: Programming flash ... \n ");
-	  if( stm32_write_flash( writeh_read_data, writeh_progress ) != STM32_OK )
-	  {
-		fprintf( stderr, "Unable to program FLASH memory.\n\n" );
-		exit( 1 );
+  // Want a single thread for all the ports?
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-engine")==0) {
+		wantengine=1;
+		break;
 	  }
-	  else {
-		printf( "host: write memory successfully completed.\n" );
-	  	fclose( fp );
+	  argind++;
+  }
+  if (wantengine && (!portlist || devselection != USART)) {
+	  fprintf( stderr, "host: -engine needs -usart and -ports\n\n" );
+	  exit(1);
+  }
+  if (wantengine && wantverify) {
+	  fprintf( stderr, "host: -verify cannot be used with -engine\n\n" );
+	  exit(1);
+  }
+
+  // Write block size, larger blocks take fewer round trips when the
+  // bootloader has the extended write
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-blocksize")==0 && argind+1<argc) {
+		blocksize=strtoul(argv[argind+1], NULL, 0);
+		if (blocksize == 0 || blocksize > STM32_WRITE_EXT_MAXSIZE) {
+			fprintf( stderr, "host: -blocksize must be 1 to %d bytes\n\n", STM32_WRITE_EXT_MAXSIZE );
+			exit(1);
+		}
+		STM32_LOG( STM32_LOG_PROGRESS, "host: %lu byte write blocks requested\n", blocksize);
+		break;
 	  }
+	  argind++;
   }
 
-  // Read flash
-  if (wantread) {
-	  printf( "host: Reading flash ... \n");
-	  if( stm32_read_flash(fflash) != STM32_OK )
+  // Want to go on from where an interrupted write stopped?
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-resume")==0) {
+		wantresume=1;
+		break;
+	  }
+	  argind++;
+  }
+
+  // USART rate
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-baud")==0 && argind+1<argc) {
+		if (strcmp(argv[argind+1],"auto")==0) {
+			wantbaudramp=1;
+			STM32_LOG( STM32_LOG_PROGRESS, "host: baud rate ramp selected\n");
+			break;
+		}
+		if ((baud=strtoul(argv[argind+1], NULL, 0)) == 0) {
+			fprintf( stderr, "host: cannot interpret the -baud value\n\n" );
+			exit(1);
+		}
+		STM32_LOG( STM32_LOG_PROGRESS, "host: %lu baud\n", baud);
+		break;
+	  }
+	  argind++;
+  }
+
+  // Want a modem line reset into the bootloader?
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-reset")==0) {
+		wantreset=1;
+		break;
+	  }
+	  argind++;
+  }
+  if (wantreset && devselection != USART) {
+	  fprintf( stderr, "host: -reset needs -usart\n\n" );
+	  exit(1);
+  }
+
+  // Want the USB-serial low latency settings?
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-lowlatency")==0) {
+		wantlowlatency=1;
+		break;
+	  }
+	  argind++;
+  }
+  if (wantlowlatency && (devselection != USART || wantengine)) {
+	  fprintf( stderr, "host: -lowlatency needs -usart and cannot be used with -engine\n\n" );
+	  exit(1);
+  }
+
+  if (wantbaudramp && (devselection != USART || wantengine)) {
+	  fprintf( stderr, "host: -baud auto needs -usart and cannot be used with -engine\n\n" );
+	  exit(1);
+  }
+  if (wantbaudramp) {
+	  argind=0;
+	  while (argind<argc-1 && strcmp(argv[argind],"-baudcache")!=0)
+		  argind++;
+	  if (argind<argc-1)
+		  snprintf( baudcachefile, sizeof( baudcachefile ), "%s", argv[argind+1] );
+	  else
+		  snprintf( baudcachefile, sizeof( baudcachefile ), "%s/.stm32ld_baud", getenv( "HOME" ) ? getenv( "HOME" ) : "." );
+  }
+
+  // Keep several write transactions in flight?
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-window")==0 && argind+1<argc) {
+		if (strcmp(argv[argind+1],"auto")==0)
+			window=STM32_WRITE_WINDOW_AUTO;
+		else if ((window=strtoul(argv[argind+1], NULL, 0)) == 0 || window > STM32_WRITE_WINDOW_MAX) {
+			fprintf( stderr, "host: -window must be auto or 1 to %d blocks\n\n", STM32_WRITE_WINDOW_MAX );
+			exit(1);
+		}
+		break;
+	  }
+	  argind++;
+  }
+  if (window && wantpipeline) {
+	  fprintf( stderr, "host: -pipeline cannot be used with -window, ignored\n" );
+	  wantpipeline=0;
+  }
+
+  // Want to rewrite only the pages that changed?
+  argind=0;
+  while (argind<argc) {
+	 if (strcmp(argv[argind],"-diff")==0)
+		wantdiff=1;
+	 else if (strcmp(argv[argind],"-diffcache")==0 && argind+1<argc)
+		diffcachefile=argv[argind+1];
+	  argind++;
+  }
+  if (wantdiff && (!wantwrite || nnodes || wantengine || (diffcachefile && portlist))) {
+	  fprintf( stderr, "host: -diff needs -write, cannot be used with -nodes or -engine, and -diffcache needs a single port\n\n" );
+	  exit(1);
+  }
+  if (wantresume && (!wantwrite || portlist || nnodes || wantdiff)) {
+	  fprintf( stderr, "host: -resume needs -write and a single device, and cannot be used with -diff\n\n" );
+	  exit(1);
+  }
+  if (wantresume) {
+	  snprintf( journalfile, sizeof( journalfile ), "%s.journal", writefile );
+	  imagecrc = stm32_crc32( 0, image, fpsize );
+	  STM32_LOG( STM32_LOG_PROGRESS, "host: write journal %s\n", journalfile);
+  }
+  if ((wantdiff || wantrepair) && ( custombaseaddress - STM32_FLASH_BASE ) % STM32_FLASH_PAGES_SIZE) {
+	  fprintf( stderr, "host: -diff and -repair rewrite whole pages, the base address must be on a %d byte page boundary\n\n", STM32_FLASH_PAGES_SIZE );
+	  exit(1);
+  }
+  // Without a cache (or before the first run) the pages are compared with a read-back
+  if (wantdiff && diffcachefile && ( fp = fopen( diffcachefile, "rb" ) ) != NULL) {
+	  fseek( fp, 0, SEEK_END );
+	  diffcachesize = ftell( fp );
+	  fseek( fp, 0, SEEK_SET );
+	  if( ( diffcache = ( u8* )malloc( diffcachesize + 1 ) ) == NULL || fread( diffcache, 1, diffcachesize, fp ) != diffcachesize )
 	  {
-		fprintf( stderr, "Unable to read FLASH memory.\n\n" );
-		fclose( fflash );
+		fprintf( stderr, "Unable to load %s\n", diffcachefile );
 		exit( 1 );
 	  }
-	  else {
-		fseek( fflash, 0, SEEK_END );
-		fflashsize = ftell( fflash );
-		fseek( fflash, 0, SEEK_SET );
-		printf( "\nhost: FLASH memory successfully read (%d bytes).\n",fflashsize);
+	  fclose( fp );
+	  STM32_LOG( STM32_LOG_PROGRESS, "host: comparing with the last image flashed, %s\n", diffcachefile);
+  }
+  else if (wantdiff)
+	  STM32_LOG( STM32_LOG_PROGRESS, "host: comparing with the device contents\n");
+
+
+  /******************************************** Loader workflow *************************************/
+  // Single device
+  if (!portlist) {
+	  jobs[ 0 ].portname = argv[2];
+	  if( loader_run( &jobs[ 0 ] ) != 0 )
+		exit( 1 );
+	  if (wantread)
 		fclose( fflash );
+	  printf( "\nhost: Done!\n\n");
+	  return 0;
+  }
+
+  // One session and one thread per port, the image is shared read-only
+  for( port = strtok( portlist, "," ); port && njobs < MAX_PORTS; port = strtok( NULL, "," ) )
+	  jobs[ njobs++ ].portname = port;
+  STM32_LOG( STM32_LOG_PROGRESS, "host: flashing %d ports in parallel\n", njobs );
+  gettimeofday( &start, NULL );
+  if (wantengine)
+	  loader_run_engine( jobs, njobs );
+  else {
+	  for( i = 0; i < njobs; i ++ )
+	  {
+		  started[ i ] = pthread_create( &threads[ i ], NULL, loader_thread, &jobs[ i ] ) == 0;
+		  if( !started[ i ] )
+			jobs[ i ].failed = "thread";
 	  }
+	  for( i = 0; i < njobs; i ++ )
+		  if( started[ i ] )
+			pthread_join( threads[ i ], NULL );
   }
 
-  // Jump to app
-  printf( "host: Jumping to app...\n");
-  stm32_jump();
+  // Per port results and summary
+  printf( "\n\nhost: results\n" );
+  for( i = 0; i < njobs; i ++ )
+  {
+	  if( jobs[ i ].failed )
+	  {
+		printf( "host: %-20s FAILED (%s) %.2f s, %lu retries\n", jobs[ i ].portname, jobs[ i ].failed, jobs[ i ].secs, jobs[ i ].s.retries );
+		nfailed ++;
+	  }
+	  else
+		printf( "host: %-20s OK %.2f s, %lu retries\n", jobs[ i ].portname, jobs[ i ].secs, jobs[ i ].s.retries );
+	  if( jobs[ i ].secs > slowest )
+		slowest = jobs[ i ].secs;
+  }
+  printf( "host: %d of %d devices flashed in %.2f s (slowest device %.2f s)\n",
+		  njobs - nfailed, njobs, loader_elapsed( &start ), slowest );
 
   printf( "\nhost: Done!\n\n");
-  return 0;
+  return nfailed ? 1 : 0;
 
 }
 
 /*******************************************************************************************/
-           
+
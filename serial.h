@@ -32,10 +32,23 @@
 ser_handler ser_open( const char *sername );
 void ser_close( ser_handler id );
 int ser_setup( ser_handler id, u32 baud, int databits, int parity, int stopbits );
+int ser_set_baud( ser_handler id, u32 baud );
 u32 ser_read( ser_handler id, u8* dest, u32 maxsize );
+u32 ser_read_exact( ser_handler id, u8* dest, u32 size, u32 timeout );
 int ser_read_byte( ser_handler id );
 u32 ser_write( ser_handler id, const u8 *src, u32 size );
 u32 ser_write_byte( ser_handler id, u8 data );
 void ser_set_timeout_ms( ser_handler id, u32 timeout );
+void ser_get_syscalls( ser_handler id, u32 *rdcalls, u32 *wrcalls );
+void ser_flush_input( ser_handler id );
+int ser_set_lines( ser_handler id, int dtr, int rts );
+
+// Any baud rate, for the rates without a termios constant (serial_linux.c)
+u32 ser_set_any_baud( int fd, u32 baud );
+
+// USB-serial latency settings (serial_linux.c)
+int ser_set_low_latency( int fd, int on );
+int ser_get_latency_timer( const char *portname );
+int ser_set_latency_timer( const char *portname, int ms );
 
 #endif
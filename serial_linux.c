@@ -0,0 +1,123 @@
+// Serial interface, Linux specific part: any baud rate with termios2/BOTHER
+// and the USB-serial latency settings
+// (kept apart from serial_posix.c, the kernel termios headers clash with <termios.h>)
+
+#include "serial.h"
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+
+// Set the given rate (in bits/s) on the port, return the rate the driver
+// actually set, 0 on failure
+u32 ser_set_any_baud( int fd, u32 baud )
+{
+  struct termios2 tio;
+
+  if( ioctl( fd, TCGETS2, &tio ) == -1 )
+    return 0;
+  tio.c_cflag &= ~CBAUD;
+  tio.c_cflag |= BOTHER;
+  tio.c_ispeed = baud;
+  tio.c_ospeed = baud;
+  if( ioctl( fd, TCSETS2, &tio ) == -1 || ioctl( fd, TCGETS2, &tio ) == -1 )
+    return 0;
+  return tio.c_ospeed;
+}
+
+// Turn ASYNC_LOW_LATENCY on or off, return the previous state (0 or 1),
+// -1 if the driver does not take it
+int ser_set_low_latency( int fd, int on )
+{
+  struct serial_struct ss;
+  int prev;
+
+  if( ioctl( fd, TIOCGSERIAL, &ss ) == -1 )
+    return -1;
+  prev = ( ss.flags & ASYNC_LOW_LATENCY ) != 0;
+  if( on )
+    ss.flags |= ASYNC_LOW_LATENCY;
+  else
+    ss.flags &= ~ASYNC_LOW_LATENCY;
+  if( prev != on && ioctl( fd, TIOCSSERIAL, &ss ) == -1 )
+    return -1;
+  return prev;
+}
+
+// Helper: sysfs latency timer of the adapter behind a port (FTDI), the
+// port name may be a symlink (/dev/serial/by-id/...). Returns SER_ERR if
+// the path does not fit
+static int ser_latency_timer_path( const char *portname, char *path, size_t size )
+{
+  char real[ PATH_MAX ];
+  const char *name;
+  int len;
+
+  if( realpath( portname, real ) == NULL )
+    snprintf( real, sizeof( real ), "%s", portname );
+  name = strrchr( real, '/' );
+  len = snprintf( path, size, "/sys/bus/usb-serial/devices/%s/latency_timer", name ? name + 1 : real );
+  return len < 0 || ( size_t )len >= size ? SER_ERR : SER_OK;
+}
+
+// Latency timer of the adapter in ms, -1 if it has none
+int ser_get_latency_timer( const char *portname )
+{
+  char path[ PATH_MAX ];
+  FILE *f;
+  int ms = -1;
+
+  if( ser_latency_timer_path( portname, path, sizeof( path ) ) != SER_OK )
+    return -1;
+  if( ( f = fopen( path, "r" ) ) != NULL )
+  {
+    if( fscanf( f, "%d", &ms ) != 1 )
+      ms = -1;
+    fclose( f );
+  }
+  return ms;
+}
+
+// Set the latency timer of the adapter, SER_ERR if it has none or writing
+// it is not permitted
+int ser_set_latency_timer( const char *portname, int ms )
+{
+  char path[ PATH_MAX ];
+  FILE *f;
+
+  if( ser_latency_timer_path( portname, path, sizeof( path ) ) != SER_OK ||
+      ( f = fopen( path, "w" ) ) == NULL )
+    return SER_ERR;
+  fprintf( f, "%d", ms );
+  return fclose( f ) == 0 ? SER_OK : SER_ERR;
+}
+
+#else
+
+u32 ser_set_any_baud( int fd, u32 baud )
+{
+  return 0;
+}
+
+int ser_set_low_latency( int fd, int on )
+{
+  return -1;
+}
+
+int ser_get_latency_timer( const char *portname )
+{
+  return -1;
+}
+
+int ser_set_latency_timer( const char *portname, int ms )
+{
+  return SER_ERR;
+}
+
+#endif
@@ -8,10 +8,19 @@
 #include <errno.h>
 #include <termios.h>
 #include <sys/select.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
-static u32 ser_timeout = SER_INF_TIMEOUT;
+// Per port timeout, so several ports can be used at once (one per thread)
+static u32 ser_timeout[ FD_SETSIZE ];
+
+// A port the per port state (and select) can be used with
+#define SER_VALID( id )   ( ( int )( id ) >= 0 && ( int )( id ) < FD_SETSIZE )
+
+// Per port syscall counters (select + read, write)
+static u32 ser_rdcalls[ FD_SETSIZE ];
+static u32 ser_wrcalls[ FD_SETSIZE ];
 
 // Open the serial port
 ser_handler ser_open( const char* sername )
@@ -20,8 +29,18 @@ ser_handler ser_open( const char* sername )
 
   if( ( fd = open( sername, O_RDWR | O_NOCTTY | O_NDELAY ) ) == -1 )
     perror( "ser_open: unable to open port" );
+  else if( !SER_VALID( fd ) )
+  {
+    fprintf( stderr, "ser_open: too many open files for select\n" );
+    close( fd );
+    fd = -1;
+  }
   else
+  {
     fcntl( fd, F_SETFL, 0 );
+    ser_timeout[ fd ] = SER_INF_TIMEOUT;
+    ser_rdcalls[ fd ] = ser_wrcalls[ fd ] = 0;
+  }
   return ( ser_handler )fd;
 }
 
@@ -31,7 +50,8 @@ void ser_close( ser_handler id )
   close( ( int )id );
 }
 
-// Helper function: get baud ID from actual baud rate
+// Helper function: get baud ID from actual baud rate, 0 if the rate has no
+// termios constant. The rates above 230400 are not defined everywhere.
 #define BAUDCASE(x)  case x: return B##x
 static u32 ser_baud_to_id( u32 baud )
 {
@@ -47,6 +67,42 @@ static u32 ser_baud_to_id( u32 baud )
     BAUDCASE( 57600 );
     BAUDCASE( 115200 );
     BAUDCASE( 230400 );
+#ifdef B460800
+    BAUDCASE( 460800 );
+#endif
+#ifdef B500000
+    BAUDCASE( 500000 );
+#endif
+#ifdef B576000
+    BAUDCASE( 576000 );
+#endif
+#ifdef B921600
+    BAUDCASE( 921600 );
+#endif
+#ifdef B1000000
+    BAUDCASE( 1000000 );
+#endif
+#ifdef B1152000
+    BAUDCASE( 1152000 );
+#endif
+#ifdef B1500000
+    BAUDCASE( 1500000 );
+#endif
+#ifdef B2000000
+    BAUDCASE( 2000000 );
+#endif
+#ifdef B2500000
+    BAUDCASE( 2500000 );
+#endif
+#ifdef B3000000
+    BAUDCASE( 3000000 );
+#endif
+#ifdef B3500000
+    BAUDCASE( 3500000 );
+#endif
+#ifdef B4000000
+    BAUDCASE( 4000000 );
+#endif
   }
   return 0;
 }
@@ -65,18 +121,42 @@ static int ser_number_of_bits_to_id( int nb )
   return 0;
 }
 
+// Change the baud rate, once the bytes already written are out.
+// Return SER_ERR if the rate cannot be set
+int ser_set_baud( ser_handler id, u32 baud )
+{
+  struct termios termdata;
+  int hnd = ( int )id;
+  u32 baudid = ser_baud_to_id( baud ), actual;
+
+  tcdrain( hnd );
+  if( baudid )
+  {
+    tcgetattr( hnd, &termdata );
+    cfsetispeed( &termdata, baudid );
+    cfsetospeed( &termdata, baudid );
+    return tcsetattr( hnd, TCSANOW, &termdata ) == 0 ? SER_OK : SER_ERR;
+  }
+
+  // Any other rate through the driver divisor
+  if( ( actual = ser_set_any_baud( hnd, baud ) ) == 0 )
+  {
+    fprintf( stderr, "ser_set_baud: baud rate %lu not supported\n", baud );
+    return SER_ERR;
+  }
+  if( actual != baud )
+    fprintf( stderr, "ser_set_baud: baud rate %lu set as %lu\n", baud, actual );
+  return SER_OK;
+}
+
+// Setup the port, return SER_ERR if the baud rate cannot be set
 int ser_setup( ser_handler id, u32 baud, int databits, int parity, int stopbits )
 {
   struct termios termdata;
   int hnd = ( int )id;
 
-  usleep( 200000 );
   tcgetattr( hnd, &termdata );
 
-  // Baud rate
-  cfsetispeed( &termdata, ser_baud_to_id( baud ) );
-  cfsetospeed( &termdata, ser_baud_to_id( baud ) );
-
   // Parity / stop bits
   termdata.c_cflag &= ~CSTOPB;
   if( parity == SER_PARITY_NONE ) // no parity
@@ -122,17 +202,28 @@ int ser_setup( ser_handler id, u32 baud, int databits, int parity, int stopbits
   // Set the attibutes now
   tcsetattr( hnd, TCSANOW, &termdata );
 
+  // Baud rate
+  if( ser_set_baud( id, baud ) != SER_OK )
+    return SER_ERR;
+
   // Flush everything
   tcflush( hnd, TCIOFLUSH );
 
   // And set blocking mode by default
   fcntl( id, F_SETFL, 0 );
+  return SER_OK;
 }
 
 // Read up to the specified number of bytes, return bytes actually read
 u32 ser_read( ser_handler id, u8* dest, u32 maxsize )
 {
-  if( ser_timeout == SER_INF_TIMEOUT )
+  u32 timeout;
+
+  if( !SER_VALID( id ) )
+    return 0;
+  timeout = ser_timeout[ ( int )id ];
+  ser_rdcalls[ ( int )id ] ++;
+  if( timeout == SER_INF_TIMEOUT )
     return ( u32 )read( ( int )id, dest, maxsize );
   else
   {
@@ -142,14 +233,65 @@ u32 ser_read( ser_handler id, u8* dest, u32 maxsize )
 
     FD_ZERO( &readfs );
     FD_SET( ( int )id, &readfs );
-    tv.tv_sec = ser_timeout / 1000000;
-    tv.tv_usec = ( ser_timeout % 1000000 ) * 1000;
+    tv.tv_sec = timeout / 1000000;
+    tv.tv_usec = timeout % 1000000;
     retval = select( ( int )id + 1, &readfs, NULL, NULL, &tv );
     if( retval == -1 || retval == 0 )
       return 0;
-    else 
-      return ( u32 )read( ( int )id, dest, maxsize );
+    ser_rdcalls[ ( int )id ] ++;
+    return ( u32 )read( ( int )id, dest, maxsize );
+  }
+}
+
+// Read exactly size bytes unless the timeout (us, for the whole transfer)
+// expires first. Bytes are taken as they arrive, as many as the driver has
+// at each wakeup. Returns the number of bytes actually read.
+u32 ser_read_exact( ser_handler id, u8* dest, u32 size, u32 timeout )
+{
+  struct timeval deadline, now, tv;
+  fd_set readfs;
+  u32 got = 0;
+  s32 left;
+  int retval;
+  ssize_t res;
+
+  if( !SER_VALID( id ) )
+    return 0;
+  gettimeofday( &deadline, NULL );
+  deadline.tv_sec += timeout / 1000000;
+  deadline.tv_usec += timeout % 1000000;
+  if( deadline.tv_usec >= 1000000 )
+  {
+    deadline.tv_sec ++;
+    deadline.tv_usec -= 1000000;
+  }
+  while( got < size )
+  {
+    if( timeout != SER_INF_TIMEOUT )
+    {
+      gettimeofday( &now, NULL );
+      left = ( deadline.tv_sec - now.tv_sec ) * 1000000 + ( deadline.tv_usec - now.tv_usec );
+      if( left <= 0 )
+        break;
+      FD_ZERO( &readfs );
+      FD_SET( ( int )id, &readfs );
+      tv.tv_sec = left / 1000000;
+      tv.tv_usec = left % 1000000;
+      ser_rdcalls[ ( int )id ] ++;
+      retval = select( ( int )id + 1, &readfs, NULL, NULL, &tv );
+      if( retval == -1 && errno == EINTR )
+        continue;
+      if( retval <= 0 )
+        break;
+    }
+    ser_rdcalls[ ( int )id ] ++;
+    res = read( ( int )id, dest + got, size - got );
+    if( res > 0 )
+      got += res;
+    else if( res == 0 || errno != EINTR )
+      break;
   }
+  return got;
 }
 
 // Read a single byte and return it (or -1 for error)
@@ -165,7 +307,10 @@ int ser_read_byte( ser_handler id )
 u32 ser_write( ser_handler id, const u8 *src, u32 size )
 {
   u32 res;
-  
+
+  if( !SER_VALID( id ) )
+    return 0;
+  ser_wrcalls[ ( int )id ] ++;
   res = ( u32 )write( ( int )id, src, size );
   return res;
 }
@@ -173,12 +318,40 @@ u32 ser_write( ser_handler id, const u8 *src, u32 size )
 // Write a byte to the serial port
 u32 ser_write_byte( ser_handler id, u8 data )
 {
+  if( !SER_VALID( id ) )
+    return 0;
+  ser_wrcalls[ ( int )id ] ++;
   return ( u32 )write( id, &data, 1 );
 }
 
 // Set communication timeout
 void ser_set_timeout_ms( ser_handler id, u32 timeout )
 {
-  ser_timeout = timeout;
+  if( SER_VALID( id ) )
+    ser_timeout[ ( int )id ] = timeout;
+}
+
+// Get the number of read (select + read) and write syscalls made on the port
+void ser_get_syscalls( ser_handler id, u32 *rdcalls, u32 *wrcalls )
+{
+  *rdcalls = SER_VALID( id ) ? ser_rdcalls[ ( int )id ] : 0;
+  *wrcalls = SER_VALID( id ) ? ser_wrcalls[ ( int )id ] : 0;
+}
+
+// Drop the bytes received and not read yet
+void ser_flush_input( ser_handler id )
+{
+  tcflush( ( int )id, TCIFLUSH );
 }
 
+// Set the DTR and RTS modem lines, 1 to assert
+int ser_set_lines( ser_handler id, int dtr, int rts )
+{
+  int bits;
+
+  if( ioctl( ( int )id, TIOCMGET, &bits ) == -1 )
+    return SER_ERR;
+  bits = dtr ? bits | TIOCM_DTR : bits & ~TIOCM_DTR;
+  bits = rts ? bits | TIOCM_RTS : bits & ~TIOCM_RTS;
+  return ioctl( ( int )id, TIOCMSET, &bits ) == -1 ? SER_ERR : SER_OK;
+}
@@ -0,0 +1,493 @@
+// STM32 loader: single thread, event driven engine for many serial links
+//
+// The blocking helpers in stm32ld.c need one thread per port. Here the same
+// bootloader workflow is a non-blocking state machine per device, and a
+// single epoll loop multiplexes all the ports. Every state is a sequence of
+// phases: send some bytes, wait for a known number of reply bytes (or the
+// phase deadline), check them and move on.
+
+#include "stm32eng.h"
+#include "serial.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+// Events handled by one epoll_wait call
+#define STM32ENG_EVENTS     64
+
+static const char *stm32eng_names[] =
+{
+  "connect", "get", "get ID", "write unprotect", "reconnect", "erase",
+  "write", "read", "go", "done", "failed"
+};
+
+// ****************************************************************************
+// Helper functions
+
+// Helper: monotonic time in us
+static u64 stm32engh_now( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( u64 )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Helper: start a phase, send len bytes (already in tx) and wait for rxlen bytes
+static void stm32engh_phase( stm32eng_dev *d, int phase, u32 txlen, u32 rxlen )
+{
+  d->phase = phase;
+  d->txlen = txlen;
+  d->txdone = 0;
+  d->rxlen = rxlen;
+  d->rxdone = 0;
+  d->deadline = stm32engh_now() + STM32_COMM_TIMEOUT;
+}
+
+// Helper: send a command (cmd, ~cmd)
+static void stm32engh_command( stm32eng_dev *d, int phase, u8 cmd, u32 rxlen )
+{
+  d->tx[ 0 ] = cmd;
+  d->tx[ 1 ] = ~cmd;
+  stm32engh_phase( d, phase, 2, rxlen );
+}
+
+// Helper: send a packet followed by its checksum
+static void stm32engh_packet( stm32eng_dev *d, int phase, const u8 *packet, u32 len, u32 rxlen )
+{
+  u8 chksum = 0;
+  u32 i;
+
+  for( i = 0; i < len; i ++ )
+    chksum ^= d->tx[ i ] = packet[ i ];
+  d->tx[ len ] = chksum;
+  stm32engh_phase( d, phase, len + 1, rxlen );
+}
+
+// Helper: send an address
+static void stm32engh_address( stm32eng_dev *d, int phase, u32 address, u32 rxlen )
+{
+  u8 addr_buf[ 4 ];
+
+  addr_buf[ 0 ] = address >> 24;
+  addr_buf[ 1 ] = ( address >> 16 ) & 0xFF;
+  addr_buf[ 2 ] = ( address >> 8 ) & 0xFF;
+  addr_buf[ 3 ] = address & 0xFF;
+  stm32engh_packet( d, phase, addr_buf, 4, rxlen );
+}
+
+// Helper: send an init byte, answered within STM32_SYNC_TIMEOUT once the
+// bootloader is up
+static void stm32engh_sync( stm32eng_dev *d )
+{
+  d->tx[ 0 ] = STM32_CMD_INIT;
+  stm32engh_phase( d, 0, 1, 1 );
+  d->deadline = stm32engh_now() + STM32_SYNC_TIMEOUT;
+}
+
+// Helper: no valid answer to the init byte, send another one while the
+// bootloader may still be starting (reset, write unprotect).
+// Returns 0 after STM32_SYNC_RETRIES init bytes.
+static int stm32engh_sync_again( stm32eng_dev *d )
+{
+  if( ( d->state != STM32ENG_CONNECT && d->state != STM32ENG_RECONNECT ) || ++ d->tries >= STM32_SYNC_RETRIES )
+    return 0;
+  stm32engh_sync( d );
+  return 1;
+}
+
+// Helper: check if the image block at offset is all 0xFF (already erased)
+static int stm32engh_erased( const stm32eng_job *job, u32 offset )
+{
+  u32 i, end = offset + STM32_WRITE_BUFSIZE;
+
+  if( end > job->imagesize )
+    end = job->imagesize;
+  for( i = offset; i < end; i ++ )
+    if( job->image[ i ] != 0xFF )
+      return 0;
+  return 1;
+}
+
+// Helper: the device is finished (done or failed), release its port
+static void stm32engh_finish( int epfd, stm32eng_dev *d, int state )
+{
+  if( state == STM32ENG_FAILED )
+    d->failed_state = d->state;
+  d->state = state;
+  if( d->fd != -1 )
+  {
+    epoll_ctl( epfd, EPOLL_CTL_DEL, d->fd, NULL );
+    ser_close( d->fd );
+    d->fd = -1;
+  }
+  d->secs = ( stm32engh_now() - d->start ) / 1000000.0;
+}
+
+// Helper: enter a state, skipping the ones the job does not need.
+// Returns 0 when the device has nothing left to do.
+static int stm32engh_enter( const stm32eng_job *job, stm32eng_dev *d, int state )
+{
+  d->state = state;
+  switch( state )
+  {
+    case STM32ENG_CONNECT:
+    case STM32ENG_RECONNECT:
+      // Drop stale input, init bytes are retried until one is answered
+      ser_flush_input( d->fd );
+      d->tries = 0;
+      stm32engh_sync( d );
+      return 1;
+
+    case STM32ENG_GET:
+      // ACK and the number of bytes to follow first
+      stm32engh_command( d, 0, STM32_CMD_GET_COMMAND, 2 );
+      return 1;
+
+    case STM32ENG_GET_ID:
+      // ACK, 1, PID high, PID low, ACK
+      stm32engh_command( d, 0, STM32_CMD_GET_ID, 5 );
+      return 1;
+
+    case STM32ENG_UNPROTECT:
+      if( !job->unprotect )
+        return stm32engh_enter( job, d, STM32ENG_ERASE );
+      stm32engh_command( d, 0, STM32_CMD_WRITE_UNPROTECT, 2 );
+      return 1;
+
+    case STM32ENG_ERASE:
+      if( !job->erase || !job->image )
+        return stm32engh_enter( job, d, STM32ENG_WRITE );
+      stm32engh_command( d, 0, STM32_CMD_ERASE_FLASH, 1 );
+      return 1;
+
+    case STM32ENG_WRITE:
+      while( job->image && job->sparse && d->offset < job->imagesize && stm32engh_erased( job, d->offset ) )
+        d->offset += STM32_WRITE_BUFSIZE;
+      if( !job->image || d->offset >= job->imagesize )
+      {
+        d->offset = 0;
+        return stm32engh_enter( job, d, STM32ENG_READ );
+      }
+      stm32engh_command( d, 0, STM32_CMD_WRITE_FLASH, 1 );
+      return 1;
+
+    case STM32ENG_READ:
+      if( d->offset >= job->readsize )
+        return stm32engh_enter( job, d, STM32ENG_GO );
+      stm32engh_command( d, 0, STM32_CMD_READ_FLASH, 1 );
+      return 1;
+
+    case STM32ENG_GO:
+      if( !job->go )
+        return 0;
+      stm32engh_command( d, 0, STM32_CMD_GO, 1 );
+      return 1;
+  }
+  return 0;
+}
+
+// Helper: the reply of the current phase is complete, check it and move on.
+// Returns 1 while the device has work to do, 0 when done, -1 on failure.
+static int stm32engh_advance( const stm32eng_job *job, stm32eng_dev *d )
+{
+  u8 *rx = d->rx;
+  u8 block[ STM32_WRITE_BUFSIZE + 1 ];
+  u32 len;
+
+  switch( d->state )
+  {
+    case STM32ENG_CONNECT:
+    case STM32ENG_RECONNECT:
+      // A NACK after a retry: an earlier init byte was taken (its ACK
+      // lost), the ones after it made an invalid command. Anything else
+      // (a byte sent while booting) gets another init byte.
+      if( rx[ 0 ] != STM32_COMM_ACK && ( rx[ 0 ] != STM32_COMM_NACK || d->tries == 0 ) )
+        return stm32engh_sync_again( d ) ? 1 : -1;
+      return stm32engh_enter( job, d, d->state == STM32ENG_CONNECT ? STM32ENG_GET : STM32ENG_ERASE );
+
+    case STM32ENG_GET:
+      if( d->phase == 0 )
+      {
+        // Version, the command list and the final ACK
+        if( rx[ 0 ] != STM32_COMM_ACK )
+          return -1;
+        stm32engh_phase( d, 1, 0, rx[ 1 ] + 2 );
+        return 1;
+      }
+      if( rx[ d->rxlen - 1 ] != STM32_COMM_ACK )
+        return -1;
+      d->major = rx[ 0 ] >> 4;
+      d->minor = rx[ 0 ] & 0x0F;
+      return stm32engh_enter( job, d, STM32ENG_GET_ID );
+
+    case STM32ENG_GET_ID:
+      if( rx[ 0 ] != STM32_COMM_ACK || rx[ 1 ] != 1 || rx[ 4 ] != STM32_COMM_ACK )
+        return -1;
+      d->chip_id = ( ( u16 )rx[ 2 ] << 8 ) | rx[ 3 ];
+      return stm32engh_enter( job, d, STM32ENG_UNPROTECT );
+
+    case STM32ENG_UNPROTECT:
+      // The device resets after the second ACK and must be reconnected
+      if( rx[ 0 ] != STM32_COMM_ACK || rx[ 1 ] != STM32_COMM_ACK )
+        return -1;
+      return stm32engh_enter( job, d, STM32ENG_RECONNECT );
+
+    case STM32ENG_ERASE:
+      if( d->phase == 1 && job->erasecount && rx[ 0 ] != STM32_COMM_ACK )
+      {
+        // Page list refused, erase the whole FLASH instead
+        stm32engh_command( d, 2, STM32_CMD_ERASE_FLASH, 1 );
+        return 1;
+      }
+      if( rx[ 0 ] != STM32_COMM_ACK )
+        return -1;
+      if( d->phase == 0 && job->erasecount )
+      {
+        // Page list: number of pages - 1, page numbers, checksum
+        block[ 0 ] = ( u8 )( job->erasecount - 1 );
+        for( len = 0; len < job->erasecount; len ++ )
+          block[ len + 1 ] = ( u8 )( job->erasefirst + len );
+        stm32engh_packet( d, 1, block, job->erasecount + 1, 1 );
+        d->deadline += job->erasecount * STM32_FLASH_PAGE_ERASE_TIME;
+        return 1;
+      }
+      if( d->phase == 0 || d->phase == 2 )
+      {
+        // Mass erase, or the fallback after a refused page list (phase 3)
+        d->tx[ 0 ] = 0xFF;
+        stm32engh_phase( d, d->phase + 1, 1, 1 );
+        return 1;
+      }
+      return stm32engh_enter( job, d, STM32ENG_WRITE );
+
+    case STM32ENG_WRITE:
+      if( rx[ 0 ] != STM32_COMM_ACK )
+        return -1;
+      if( d->phase == 0 )
+        stm32engh_address( d, 1, job->baseaddress + d->offset, 1 );
+      else if( d->phase == 1 )
+      {
+        len = job->imagesize - d->offset;
+        if( len > STM32_WRITE_BUFSIZE )
+          len = STM32_WRITE_BUFSIZE;
+        block[ 0 ] = ( u8 )( len - 1 );
+        memcpy( block + 1, job->image + d->offset, len );
+        d->blocklen = len;
+        stm32engh_packet( d, 2, block, len + 1, 1 );
+      }
+      else
+      {
+        d->offset += d->blocklen;
+        return stm32engh_enter( job, d, STM32ENG_WRITE );
+      }
+      return 1;
+
+    case STM32ENG_READ:
+      if( d->phase == 3 )
+      {
+        len = job->readsize - d->offset;
+        if( len > STM32_WRITE_BUFSIZE )
+          len = STM32_WRITE_BUFSIZE;
+        memcpy( d->readbuf + d->offset, rx, len );
+        d->offset += STM32_WRITE_BUFSIZE;
+        return stm32engh_enter( job, d, STM32ENG_READ );
+      }
+      if( rx[ 0 ] != STM32_COMM_ACK )
+        return -1;
+      if( d->phase == 0 )
+        stm32engh_address( d, 1, job->baseaddress + d->offset, 1 );
+      else if( d->phase == 1 )
+      {
+        block[ 0 ] = STM32_WRITE_BUFSIZE - 1;
+        stm32engh_packet( d, 2, block, 1, 1 );
+      }
+      else
+        stm32engh_phase( d, 3, 0, STM32_WRITE_BUFSIZE );
+      return 1;
+
+    case STM32ENG_GO:
+      if( rx[ 0 ] != STM32_COMM_ACK )
+        return -1;
+      if( d->phase == 0 )
+      {
+        stm32engh_address( d, 1, job->baseaddress, 1 );
+        return 1;
+      }
+      return 0;
+  }
+  return -1;
+}
+
+// Helper: move bytes in both directions as far as the port allows.
+// Returns 1 while the device has work to do, 0 when done, -1 on failure.
+static int stm32engh_service( const stm32eng_job *job, stm32eng_dev *d, u32 events )
+{
+  ssize_t res;
+
+  if( d->txdone < d->txlen && !( events & ( EPOLLERR | EPOLLHUP ) ) )
+  {
+    res = write( d->fd, d->tx + d->txdone, d->txlen - d->txdone );
+    if( res > 0 )
+    {
+      d->txdone += res;
+      // The answer to an init byte is timed from when the byte left, the
+      // port may wait a while for its first turn (other ports setting up)
+      if( d->txdone == d->txlen && ( d->state == STM32ENG_CONNECT || d->state == STM32ENG_RECONNECT ) )
+        d->deadline = stm32engh_now() + STM32_SYNC_TIMEOUT;
+    }
+    else if( res == -1 && errno != EAGAIN && errno != EINTR )
+      return -1;
+  }
+  // A device may hang up right after its last reply (GO): the reply is
+  // read first, the hang up only fails a phase still waiting for bytes
+  if( ( events & ( EPOLLIN | EPOLLHUP ) ) && d->rxdone < d->rxlen )
+  {
+    res = read( d->fd, d->rx + d->rxdone, d->rxlen - d->rxdone );
+    if( res > 0 )
+      d->rxdone += res;
+    else if( res == 0 || ( errno != EAGAIN && errno != EINTR ) )
+      return -1;
+  }
+  if( d->txdone == d->txlen && d->rxdone == d->rxlen )
+    return stm32engh_advance( job, d );
+  if( events & ( EPOLLERR | EPOLLHUP ) )
+    return -1;
+  return 1;
+}
+
+// Helper: watch the port for output only while there is something to send
+static void stm32engh_watch( int epfd, stm32eng_dev *d )
+{
+  struct epoll_event ev;
+  u32 events = EPOLLIN | ( d->txdone < d->txlen ? EPOLLOUT : 0 );
+
+  if( events == d->events )
+    return;
+  memset( &ev, 0, sizeof( ev ) );
+  ev.events = events;
+  ev.data.ptr = d;
+  epoll_ctl( epfd, EPOLL_CTL_MOD, d->fd, &ev );
+  d->events = events;
+}
+
+// ****************************************************************************
+// Engine
+
+const char* stm32eng_state_name( int state )
+{
+  return state >= STM32ENG_CONNECT && state <= STM32ENG_FAILED ? stm32eng_names[ state ] : "?";
+}
+
+int stm32eng_run( const stm32eng_job *job, stm32eng_dev *devs, int ndevs )
+{
+  struct epoll_event ev, events[ STM32ENG_EVENTS ];
+  stm32eng_dev *d;
+  int epfd, active = 0, nfailed = 0, n, i, res;
+  u64 now, next_check;
+
+  if( ( epfd = epoll_create1( 0 ) ) == -1 )
+  {
+    perror( "stm32eng_run: epoll_create1" );
+    return ndevs;
+  }
+
+  // Open all the ports and start the workflow on each of them
+  for( i = 0; i < ndevs; i ++ )
+  {
+    d = &devs[ i ];
+    d->start = stm32engh_now();
+    d->state = STM32ENG_CONNECT;
+    d->offset = 0;
+    if( ( d->fd = ser_open( d->portname ) ) == -1 )
+    {
+      stm32engh_finish( epfd, d, STM32ENG_FAILED );
+      continue;
+    }
+    if( ser_setup( d->fd, job->baud, SER_DATABITS_8, SER_PARITY_NONE, SER_STOPBITS_1 ) != SER_OK )
+    {
+      stm32engh_finish( epfd, d, STM32ENG_FAILED );
+      continue;
+    }
+    fcntl( d->fd, F_SETFL, O_NONBLOCK );
+    stm32engh_enter( job, d, STM32ENG_CONNECT );
+    memset( &ev, 0, sizeof( ev ) );
+    ev.events = d->events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = d;
+    if( epoll_ctl( epfd, EPOLL_CTL_ADD, d->fd, &ev ) == -1 )
+    {
+      perror( "stm32eng_run: epoll_ctl" );
+      stm32engh_finish( epfd, d, STM32ENG_FAILED );
+      continue;
+    }
+    active ++;
+  }
+
+  // First scan right away, the init byte deadlines are short
+  next_check = stm32engh_now();
+  while( active > 0 )
+  {
+    now = stm32engh_now();
+    n = epoll_wait( epfd, events, STM32ENG_EVENTS, next_check > now ? ( int )( ( next_check - now + 999 ) / 1000 ) : 0 );
+    if( n == -1 && errno != EINTR )
+    {
+      perror( "stm32eng_run: epoll_wait" );
+      break;
+    }
+    for( i = 0; i < n; i ++ )
+    {
+      d = ( stm32eng_dev* )events[ i ].data.ptr;
+      if( d->fd == -1 )
+        continue;
+      if( ( res = stm32engh_service( job, d, events[ i ].events ) ) != 1 )
+      {
+        stm32engh_finish( epfd, d, res == 0 ? STM32ENG_DONE : STM32ENG_FAILED );
+        active --;
+      }
+      else
+      {
+        stm32engh_watch( epfd, d );
+        // Init bytes wait less than the scan period
+        if( d->deadline < next_check )
+          next_check = d->deadline;
+      }
+    }
+
+    // Deadlines: only scanned when the earliest one may have expired,
+    // so the per event cost does not grow with the number of devices
+    now = stm32engh_now();
+    if( now < next_check )
+      continue;
+    next_check = now + STM32_COMM_TIMEOUT;
+    for( i = 0; i < ndevs; i ++ )
+    {
+      d = &devs[ i ];
+      if( d->fd == -1 )
+        continue;
+      if( d->deadline <= now && stm32engh_sync_again( d ) )
+        stm32engh_watch( epfd, d );
+      else if( d->deadline <= now )
+      {
+        stm32engh_finish( epfd, d, STM32ENG_FAILED );
+        active --;
+        continue;
+      }
+      if( d->deadline < next_check )
+        next_check = d->deadline;
+    }
+  }
+
+  for( i = 0; i < ndevs; i ++ )
+  {
+    if( devs[ i ].fd != -1 )
+      stm32engh_finish( epfd, &devs[ i ], STM32ENG_FAILED );
+    if( devs[ i ].state != STM32ENG_DONE )
+      nfailed ++;
+  }
+  close( epfd );
+  return nfailed;
+}
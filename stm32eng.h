@@ -0,0 +1,77 @@
+// STM32 loader: single thread, event driven engine for many serial links
+
+#ifndef __STM32ENG_H__
+#define __STM32ENG_H__
+
+#include "type.h"
+#include "stm32ld.h"
+
+// Device states, in workflow order
+enum
+{
+  STM32ENG_CONNECT = 0,
+  STM32ENG_GET,
+  STM32ENG_GET_ID,
+  STM32ENG_UNPROTECT,
+  STM32ENG_RECONNECT,
+  STM32ENG_ERASE,
+  STM32ENG_WRITE,
+  STM32ENG_READ,
+  STM32ENG_GO,
+  STM32ENG_DONE,
+  STM32ENG_FAILED
+};
+
+// Largest single transmission or reception (data block + length + checksum)
+#define STM32ENG_MAX_IO     ( STM32_WRITE_BUFSIZE + 2 )
+
+// What to do on every device, shared by all of them and never modified
+typedef struct
+{
+  const u8 *image; //firmware image, NULL for no write
+  u32 imagesize;
+  u32 baseaddress; //FLASH base address for write/read/jump
+  u32 baud;
+  int unprotect; //write unprotect (and reconnect) before erasing
+  int erase; //erase before writing
+  u32 erasefirst, erasecount; //pages to erase, 0 pages for a mass erase
+  int sparse; //do not send all 0xFF blocks (needs erase)
+  int go; //jump to the application at the end
+  u32 readsize; //bytes read back into each device readbuf, 0 for no read
+} stm32eng_job;
+
+// One device
+typedef struct
+{
+  // Settings
+  const char *portname;
+  u8 *readbuf; //job readsize bytes
+
+  // Results
+  int state; //STM32ENG_DONE or STM32ENG_FAILED once finished
+  int failed_state; //state the device failed in
+  u8 major, minor; //bootloader version
+  u16 chip_id;
+  double secs;
+
+  // Engine state
+  int fd;
+  int phase; //step within the state
+  u32 events; //epoll events currently watched
+  u32 offset; //image or read offset
+  u32 blocklen; //bytes in the block being written
+  int tries; //init bytes sent so far while connecting
+  u8 tx[ STM32ENG_MAX_IO ];
+  u32 txlen, txdone;
+  u8 rx[ STM32ENG_MAX_IO ];
+  u32 rxlen, rxdone;
+  u64 deadline; //us, monotonic clock
+  u64 start;
+} stm32eng_dev;
+
+// Run the job on all the devices from the calling thread, return the number
+// of devices that failed
+int stm32eng_run( const stm32eng_job *job, stm32eng_dev *devs, int ndevs );
+const char* stm32eng_state_name( int state );
+
+#endif
@@ -1,95 +1,115 @@
 // STM32 bootloader client
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
 #include "serial.h"
+#include "canif.h"
 #include "type.h"
 #include "stm32ld.h"
 
-// Peripheral handles
-static ser_handler stm32_ser_id = ( ser_handler )-1; //serial port
-static HANDLE h; //CAN device
+// CAN receive ring access
+#define STM32_CAN_RING_USED( r )  ( ( r )->head - ( r )->tail )
+#define STM32_CAN_RING_FREE( r )  ( STM32_CAN_RXRING_SIZE - STM32_CAN_RING_USED( r ) )
+#define STM32_CAN_RING_GET( r )   ( ( r )->data[ ( ( r )->tail ++ ) & ( STM32_CAN_RXRING_SIZE - 1 ) ] )
+#define STM32_CAN_RING_PUT( r, b ) ( ( r )->data[ ( ( r )->head ++ ) & ( STM32_CAN_RXRING_SIZE - 1 ) ] = ( b ) )
 
+int stm32_log_level = STM32_LOG_PROGRESS;
 
 // ****************************************************************************
 // Helper functions and macros
 
+static int stm32h_CANnegotiate( stm32_session *s );
+static int stm32h_read_byte_timeout( stm32_session *s, u32 timeout );
+static int stm32h_write_block_retry( stm32_session *s, u32 address, u8 *data, u32 datalen );
+
 // Check initialization
 #define STM32_CHECK_INIT\
-  if( stm32_ser_id == ( ser_handler )-1 )\
+  if( s->ser_id == ( ser_handler )-1 )\
     return STM32_NOT_INITIALIZED_ERROR
 
 // Check received byte
 #define STM32_EXPECT( expected )\
-  if(stm32h_read_byte() != expected )\
+  if(stm32h_read_byte( s ) != expected )\
     return STM32_COMM_ERROR;
 
 #define STM32_READ_AND_CHECK( x )\
-  if( ( x = stm32h_read_byte() ) == -1 )\
+  if( ( x = stm32h_read_byte( s ) ) == -1 )\
     return STM32_COMM_ERROR;
 
 // Helper: send a command to the STM32 chip
-static int stm32h_send_command( u8 cmd )
+static int stm32h_send_command( stm32_session *s, u8 cmd )
 {
 
-  if (devselection == USART) {
-	  ser_write_byte( stm32_ser_id, cmd );
-	  ser_write_byte( stm32_ser_id, ~cmd );
-  }
-
-  else if (devselection == CAN) {
-	  stm32h_CANwrite_byte(cmd);
-	  stm32h_CANwrite_byte(~cmd);
-  }
+  u8 buf[ 2 ];
 
+  // Command and complement go out together
+  buf[ 0 ] = cmd;
+  buf[ 1 ] = ~cmd;
+  if (s->devselection == USART) return ser_write( s->ser_id, buf, 2 ) == 2 ? STM32_OK : STM32_COMM_ERROR;
+  else if (s->devselection == CAN) stm32h_CANwrite_bytes(s, buf, 2);
+  return STM32_OK;
 }
 
 // Helper: read a byte from STM32 with timeout
-static int stm32h_read_byte()
+static int stm32h_read_byte( stm32_session *s )
+{
+  if (s->devselection == USART) return ser_read_byte( s->ser_id );
+  else if (s->devselection == CAN) return stm32h_CANread_byte( s );
+}
+
+// Helper: read a sequence of bytes from STM32 waiting at most timeout us,
+// return the number of bytes read
+static u32 stm32h_read_bytes_timeout( stm32_session *s, u8 *dst, u32 len, u32 timeout )
+{
+  if (s->devselection == CAN) return stm32h_CANread_bytes( s, dst, len, timeout );
+  // One deadline for the whole block, the bytes come in as fast as the link allows
+  return ser_read_exact( s->ser_id, dst, len, timeout );
+}
+
+// Helper: read a sequence of bytes from STM32, return the number of bytes read
+static u32 stm32h_read_bytes( stm32_session *s, u8 *dst, u32 len )
 {
-  if (devselection == USART) return ser_read_byte( stm32_ser_id );
-  else if (devselection == CAN) return stm32h_CANread_byte();
+  return stm32h_read_bytes_timeout( s, dst, len, STM32_COMM_TIMEOUT );
 }
 
 // Helper: append a checksum to a packet and send it
-static int stm32h_send_packet_with_checksum( u8 *packet, u32 len )
+// The checksum is computed while building the buffer, then the whole phase
+// goes out with a single write (or a single batch of CAN frames)
+static int stm32h_send_packet_with_checksum( stm32_session *s, u8 *packet, u32 len )
 {
+  // Largest packet: a windowed write block (the extended erase page list is shorter)
+  u8 buf[ STM32_WINDOW_HDRSIZE + STM32_WRITE_EXT_MAXSIZE + 1 ];
   u8 chksum = 0;
   u32 i, res;
 
-  if (devselection == USART) {
-
-	  for( i = 0; i < len; i ++ )
-		chksum ^= packet[ i ];
-	  if (len==4) printf("\n\t\thost: actual packet (N, N+1) length: %d, data: %x %x %x %x", len, *packet, *(packet+1), *(packet+2), *(packet+3));
-	  else printf("\n\t\thost: actual packet (N, N+1) length: %d, data: %x %x %x %x %x ...", len, *packet, *(packet+1), *(packet+2), *(packet+3), *(packet+4));
-	  res = ser_write( stm32_ser_id, packet, len );
-	  printf("\n\t\thost: bytes actually sent: %d", res);
-	  printf("\n\t\thost: checksum: %x", chksum);
-	  res = ser_write_byte( stm32_ser_id, chksum );
-	  printf("\n\t\thost: bytes actually sent: %d", res);
-	  return STM32_OK;
+  if( len + 1 > sizeof( buf ) )
+    return STM32_COMM_ERROR;
+  for( i = 0; i < len; i ++ )
+    chksum ^= buf[ i ] = packet[ i ];
+  buf[ len ] = chksum;
+  if (len==4) STM32_LOG( STM32_LOG_TRACE, "\n\t\thost: actual packet (N, N+1) length: %lu, data: %x %x %x %x", len, *packet, *(packet+1), *(packet+2), *(packet+3));
+  else STM32_LOG( STM32_LOG_TRACE, "\n\t\thost: actual packet (N, N+1) length: %lu, data: %x %x %x %x %x ...", len, *packet, *(packet+1), *(packet+2), *(packet+3), *(packet+4));
+  STM32_LOG( STM32_LOG_TRACE, "\n\t\thost: checksum: %x", chksum);
+
+  if (s->devselection == USART) {
+	  res = ser_write( s->ser_id, buf, len + 1 );
+	  STM32_LOG( STM32_LOG_TRACE, "\n\t\thost: bytes actually sent: %lu", res);
+	  return res == len + 1 ? STM32_OK : STM32_COMM_ERROR;
   }
 
-  else if (devselection == CAN) {
-
-	  for( i = 0; i < len; i ++ )
-	    chksum ^= packet[ i ];
-	  if (len==4) printf("\n\t\thost: actual packet (N, N+1) length: %d, data: %x %x %x %x", len, *packet, *(packet+1), *(packet+2), *(packet+3));
-	  else printf("\n\t\thost: actual packet (N, N+1) length: %d, data: %x %x %x %x %x ...", len, *packet, *(packet+1), *(packet+2), *(packet+3), *(packet+4));
-
-	  for( i = 0; i < len; i ++ )
-		  stm32h_CANwrite_byte(*(packet+i));
-
-	  //printf("\n\t\thost: bytes actually sent: %d", res);
-	  printf("\n\t\thost: checksum: %x", chksum);
-	  stm32h_CANwrite_byte(chksum);
-	  //printf("\n\t\thost: bytes actually sent: %d", res);
+  else if (s->devselection == CAN) {
+	  stm32h_CANwrite_bulk(s, buf, len + 1);
 	  return STM32_OK;
   }
+
+  return STM32_COMM_ERROR;
 }
 
 // Helper: send an address to STM32
-static int stm32h_send_address( u32 address )
+static int stm32h_send_address( stm32_session *s, u32 address )
 {
   u8 addr_buf[ 4 ];
 
@@ -97,121 +117,292 @@ static int stm32h_send_address( u32 address )
   addr_buf[ 1 ] = ( address >> 16 ) & 0xFF;
   addr_buf[ 2 ] = ( address >> 8 ) & 0xFF;
   addr_buf[ 3 ] = address & 0xFF;
-  return stm32h_send_packet_with_checksum( addr_buf, 4 );
+  return stm32h_send_packet_with_checksum( s, addr_buf, 4 );
 }
 
 // Helper: intiate BL communication
-static int stm32h_connect_to_bl()
+static int stm32h_connect_to_bl( stm32_session *s )
 {
-  int res, log;
+  int res, log, tries;
 
-  if (devselection == USART) {
+  if (s->devselection == USART) {
 
-	  // Flush all incoming data
-	  ser_set_timeout_ms( stm32_ser_id, SER_NO_TIMEOUT );
-	  while( stm32h_read_byte() != -1 );
-	  ser_set_timeout_ms( stm32_ser_id, STM32_COMM_TIMEOUT );
-
-	  // Initiate communication
-	  ser_write_byte( stm32_ser_id, STM32_CMD_INIT );
-	  printf("\nhost: init byte sent\n");
-	  res = stm32h_read_byte();
-	  //while( (log = stm32h_read_byte()) != -1 )
-		// printf("%c", log);
-	  //printf("\n");
-	  //printf("res: %c", res);
-	  //return res == STM32_COMM_ACK || res == STM32_COMM_NACK ? STM32_OK : STM32_INIT_ERROR;
-	  if (res == STM32_COMM_ACK) {
-		  return STM32_OK;
+	  // Drop stale input, then send init bytes until one is answered: the
+	  // bootloader may still be starting (reset, write unprotect)
+	  ser_flush_input( s->ser_id );
+	  for( tries = 0; tries < STM32_SYNC_RETRIES; tries ++ )
+	  {
+		  ser_write_byte( s->ser_id, STM32_CMD_INIT );
+		  STM32_LOG( STM32_LOG_PROTOCOL, "\nhost: init byte sent\n");
+		  res = stm32h_read_byte_timeout( s, STM32_SYNC_TIMEOUT );
+		  // A NACK after a retry: an earlier init byte was taken (its ACK
+		  // lost), the ones after it made an invalid command
+		  if( res == STM32_COMM_ACK || ( res == STM32_COMM_NACK && tries > 0 ) )
+			  return STM32_OK;
 	  }
-	  else return STM32_INIT_ERROR;
+	  return STM32_INIT_ERROR;
   }
-  else if (devselection == CAN) {
+  else if (s->devselection == CAN) {
+	  // After a (re)connection the bootloader is back to one byte per frame
+	  s->can_node_framed[ s->can_sel ] = s->can_node_fd[ s->can_sel ] = 0;
+	  s->can_framed = s->can_fd = 0;
+	  s->can_rxsel->head = s->can_rxsel->tail = 0;
+
 	  // Initiate communication
-	  stm32h_CANwrite_byte(STM32_CMD_INIT);
-	  printf("\nhost: init byte sent");
-	  res = stm32h_CANread_byte();
-	  //while( (log = stm32h_read_byte()) != -1 )
+	  stm32h_CANwrite_byte(s, STM32_CMD_INIT);
+	  STM32_LOG( STM32_LOG_PROTOCOL, "\nhost: init byte sent");
+	  res = stm32h_CANread_byte(s);
+	  //while( (log = stm32h_read_byte( s )) != -1 )
 	 //	 printf("%c", log);
 	  //printf("\n");
 	  //printf("res: %c", res);
 	  //return res == STM32_COMM_ACK || res == STM32_COMM_NACK ? STM32_OK : STM32_INIT_ERROR;
-	  if (res == STM32_COMM_ACK) {
-	  	  return STM32_OK;
-	  }
-	  else return STM32_INIT_ERROR;
+	  if (res != STM32_COMM_ACK) return STM32_INIT_ERROR;
+
+	  // Switch back to multi-byte (and FD) frames if the bootloader supports them
+	  return stm32h_CANnegotiate(s);
   }
 
 }
 
 // Helper: send byte to STM32
-static int stm32h_send_byte( ser_handler stm32_ser_id, u8 byte ) {
-	if (devselection == USART) ser_write_byte( stm32_ser_id, byte );
-	else if (devselection == CAN) stm32h_CANwrite_byte( byte );
+static int stm32h_send_byte( stm32_session *s, u8 byte ) {
+	if (s->devselection == USART) ser_write_byte( s->ser_id, byte );
+	else if (s->devselection == CAN) stm32h_CANwrite_byte( s, byte );
 	else return -1;
 	return STM32_OK;
 }
 
-u8 stm32h_CANread_byte() {
-	TPCANRdMsg msgt;
-	TPCANMsg msg;
-	//TPDIAG stats;
-	//stats.dwErrorCounter=0;
-	__u32 ret;
-	DWORD status;
+/* Helper: store one received frame into the receive ring of its sender.
+ * Returns 1 if the frame carried data, 0 if it was a status frame. */
+static int stm32h_CANqueue_frame(stm32_session *s, const canif_msg *msg) {
+	stm32_can_ring *r = &s->can_rx[ 0 ];
+	u32 i;
+
+	/* Status frames were already reported by the CAN layer. */
+	if (msg->flags & CANIF_MSG_STATUS) {
+		fprintf( stderr, "CAN status/error frame received.\n");
+		return 0;
+	}
+
+	/* In multicast mode every node answers on its own ID. */
+	for (i=0; i<(u32)s->can_nnodes; i++)
+		if (msg->id == STM32_CAN_ID_FROM_NODE(s->can_nodes[i])) {
+			r = &s->can_rx[ i + 1 ];
+			break;
+		}
+
+	/* Every byte of the frame is kept, not only DATA[0]. */
+	if (STM32_CAN_RING_FREE(r) < msg->len) {
+		fprintf( stderr, "CAN receive ring overflow.\n");
+		return 0;
+	}
+	for (i=0; i<msg->len; i++)
+		STM32_CAN_RING_PUT(r, msg->data[i]);
+	s->can_rxframes++;
+	s->can_rxbytes += msg->len;
+	return 1;
+}
+
+/* Helper: refill the receive rings until ring r has data or the timeout (us) expires.
+ * Whatever else is already queued in the driver is taken in the same call. */
+static void stm32h_CANfill_ring(stm32_session *s, stm32_can_ring *r, u32 timeout) {
+	canif_msg msgs[ STM32_CAN_RXBATCH ];
+	struct timeval start, now;
+	u32 n, i, room, elapsed = 0;
+
+	gettimeofday( &start, NULL );
+	while (STM32_CAN_RING_USED(r) == 0) {
+		/* Only ask for as many frames as surely fit into the ring. */
+		room = STM32_CAN_RING_FREE(r) / (s->can_fd ? CANIF_FD_MAX_DLEN : STM32_CAN_MAX_DLEN);
+		if (room > STM32_CAN_RXBATCH) room = STM32_CAN_RXBATCH;
+		n = canif_read(s->can_id, msgs, room, timeout - elapsed);
+		for (i=0; i<n; i++) stm32h_CANqueue_frame(s, &msgs[i]);
+		gettimeofday( &now, NULL );
+		elapsed = ( now.tv_sec - start.tv_sec ) * 1000000 + ( now.tv_usec - start.tv_usec );
+		if (STM32_CAN_RING_USED(r) == 0 && (n == 0 || elapsed >= timeout)) {
+			/* Nothing within the timeout, notify. */
+			fprintf( stderr, "CAN reception error.\n" );
+			return;
+		}
+	}
+}
+
+/* Helper: read one byte from a given ring, -1 on timeout. */
+static int stm32h_CANread_ring_byte(stm32_session *s, stm32_can_ring *r, u32 timeout) {
+	if (STM32_CAN_RING_USED(r) == 0) stm32h_CANfill_ring(s, r, timeout);
+	if (STM32_CAN_RING_USED(r) == 0) return -1;
+	return STM32_CAN_RING_GET(r);
+}
+
+int stm32h_CANread_byte(stm32_session *s) {
+	return stm32h_CANread_ring_byte(s, s->can_rxsel, STM32_COMM_TIMEOUT);
+}
+
+u32 stm32h_CANread_bytes(stm32_session *s, u8 *dst, u32 len, u32 timeout) {
+	stm32_can_ring *r = s->can_rxsel;
+	u32 got = 0, chunk;
+
+	while (got < len) {
+		if (STM32_CAN_RING_USED(r) == 0) {
+			stm32h_CANfill_ring(s, r, timeout);
+			if (STM32_CAN_RING_USED(r) == 0) break;
+		}
+		chunk = STM32_CAN_RING_USED(r);
+		if (chunk > len - got) chunk = len - got;
+		for (; chunk > 0; chunk--)
+			dst[got++] = STM32_CAN_RING_GET(r);
+	}
+	return got;
+}
+
+/* Helper: split a byte sequence into frames and send them in batches.
+ * Classic frames carry 1 byte (or up to 8 once framing is negotiated),
+ * FD frames up to 64 bytes with a valid FD length, so no padding is needed. */
+static void stm32h_CANwrite_frames(stm32_session *s, const u8 *data, u32 len, int fd) {
+	canif_msg msgs[ STM32_CAN_TXBATCH ];
+	u32 chunk, n;
+
+	s->can_txbytes += len;
+	while (len > 0) {
+		for (n=0; n<STM32_CAN_TXBATCH && len>0; n++) {
+			if (fd) chunk = canif_fd_len(len);
+			else chunk = s->can_framed ? (len > STM32_CAN_MAX_DLEN ? STM32_CAN_MAX_DLEN : len) : 1;
+			memset(&msgs[n], 0, sizeof(canif_msg));
+			memcpy(msgs[n].data, data, chunk);
+			msgs[n].len=chunk;
+			msgs[n].id=s->can_txid;
+			if (fd) msgs[n].flags = CANIF_MSG_FD | CANIF_MSG_BRS;
+			data += chunk;
+			len -= chunk;
+		}
 
-	/* Fetch various CAN statistics. */
-	//LINUX_CAN_Statistics( h, &stats);
-	//printf("reads count %d.\n", stats.dwReadCounter );
-	//if (stats.dwErrorCounter!=0) fprintf( stderr, "CAN error occurred somewhen error counter: %d .\n", stats.dwErrorCounter );
+		/* Fire! The whole batch is handed to the CAN layer at once. */
+		if (canif_write(s->can_id, msgs, n) != n) fprintf( stderr, "CAN transmission error.\n" );
+		s->can_txframes += n;
+	}
+}
 
-	/* Blocking read. */
-	ret = LINUX_CAN_Read(h, &msgt);
-	msg = msgt.Msg;
+void stm32h_CANwrite_bytes(stm32_session *s, const u8 *data, u32 len) {
+	stm32h_CANwrite_frames(s, data, len, 0);
+}
 
-	/* If error returned by CAN_Read, notify. */
-	if (ret != 0) fprintf( stderr, "CAN reception error.\n" );
+/* Bulk payloads go out in FD frames when negotiated, in classic frames otherwise. */
+void stm32h_CANwrite_bulk(stm32_session *s, const u8 *data, u32 len) {
+	stm32h_CANwrite_frames(s, data, len, s->can_fd && len > STM32_CAN_MAX_DLEN);
+}
 
-	/* Fetch CAN status. 0x0 means all right, 0x20 means receive queue empty, which is all right too. */
-	status = CAN_Status(h);
-	if (status !=0 && status != 0x20) fprintf( stderr, "CAN status error. status: %x \n", status);
+void stm32h_CANwrite_byte(stm32_session *s, u8 data) {
+	stm32h_CANwrite_bytes(s, &data, 1);
+}
 
-	/* If error detected, the PEAK manual says a STATUS packet is inserted in the receive queue
-	 * and the error code is within DATA[3]
-	 */
-	if (msg.MSGTYPE==MSGTYPE_STATUS) {
-		fprintf( stderr, "STATUS MESSAGE RECEIVED; ERROR CODE %x.\n", msg.DATA[3]);
+// Helper: negotiate multi-byte framing, then CAN FD bulk transfers if requested,
+// with the selected node. Both are dropped by the bootloader on every reset.
+static int stm32h_CANnegotiate(stm32_session *s) {
+	if (stm32_has_cap(s, STM32_CMD_CAN_FRAMING) && !s->can_framed) {
+		// Pack up to 8 bytes per CAN frame in both directions
+		stm32h_send_command( s, STM32_CMD_CAN_FRAMING );
+		STM32_EXPECT( STM32_COMM_ACK );
+		s->can_node_framed[ s->can_sel ] = s->can_framed = 1;
+		STM32_LOG( STM32_LOG_PROGRESS, "\nhost: multi-byte CAN framing enabled");
+	}
+	if (s->canfdselection && stm32_has_cap(s, STM32_CMD_CAN_FD) && s->can_id->canfd && !s->can_fd) {
+		// Bulk data in 64-byte FD frames, commands and ACKs stay classic
+		stm32h_send_command( s, STM32_CMD_CAN_FD );
+		STM32_EXPECT( STM32_COMM_ACK );
+		s->can_node_fd[ s->can_sel ] = s->can_fd = 1;
+		STM32_LOG( STM32_LOG_PROGRESS, "\nhost: CAN FD bulk transfers enabled");
 	}
+	return STM32_OK;
+}
+
+// Helper: report CAN throughput against the one byte per frame baseline
+static void stm32h_CANreport( stm32_session *s, const char *what, u32 bytes, const struct timeval *start,
+		u32 txframes, u32 rxframes, u32 txbytes, u32 rxbytes ) {
+	struct timeval now;
+	double secs;
+
+	gettimeofday( &now, NULL );
+	secs = ( now.tv_sec - start->tv_sec ) + ( now.tv_usec - start->tv_usec ) / 1000000.0;
+	txframes = s->can_txframes - txframes;
+	rxframes = s->can_rxframes - rxframes;
+	txbytes = s->can_txbytes - txbytes;
+	rxbytes = s->can_rxbytes - rxbytes;
+	STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: %s %lu bytes in %.3f s, %.0f bytes/s", what, bytes, secs, secs > 0 ? bytes / secs : 0 );
+	STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: %lu CAN frames sent, %lu received (%lu + %lu at one byte per frame, %.1fx fewer)",
+			txframes, rxframes, txbytes, rxbytes,
+			txframes + rxframes ? ( double )( txbytes + rxbytes ) / ( txframes + rxframes ) : 0 );
+}
 
-	return msg.DATA[0];
+// Helper: report serial throughput and the syscalls spent per block
+static void stm32h_SERreport( stm32_session *s, const char *what, u32 bytes, u32 blocks, const struct timeval *start,
+		u32 rdcalls, u32 wrcalls ) {
+	struct timeval now;
+	double secs;
+	u32 rd, wr;
+
+	gettimeofday( &now, NULL );
+	secs = ( now.tv_sec - start->tv_sec ) + ( now.tv_usec - start->tv_usec ) / 1000000.0;
+	ser_get_syscalls( s->ser_id, &rd, &wr );
+	rd -= rdcalls;
+	wr -= wrcalls;
+	STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: %s %lu bytes in %.3f s, %.0f bytes/s", what, bytes, secs, secs > 0 ? bytes / secs : 0 );
+	STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: %lu write and %lu read syscalls, %.1f + %.1f per block",
+			wr, rd, blocks ? ( double )wr / blocks : 0, blocks ? ( double )rd / blocks : 0 );
 }
 
-void stm32h_CANwrite_byte(u8 data) {
-	TPCANMsg msg;
-	DWORD ret;
-	//TPDIAG stats;
-	//stats.dwErrorCounter=0;
+// Set the nodes to be flashed together (CBBL node addressing), 0 nodes for single node sessions
+int stm32_CAN_set_nodes( stm32_session *s, const u8 *nodes, int nnodes ) {
+	if (nnodes > STM32_CAN_MAX_NODES) return STM32_INIT_ERROR;
+	memcpy(s->can_nodes, nodes, nnodes);
+	s->can_nnodes = nnodes;
+	stm32_CAN_select_node(s, STM32_CAN_ALL_NODES);
+	return STM32_OK;
+}
 
-	/* Initialize packet. */
-	msg.DATA[0]=data;
+// Address a single node (unicast), or all of them with STM32_CAN_ALL_NODES (broadcast)
+// The framing follows the addressed node: a broadcast is framed only if every
+// node negotiated it, a node still at one byte per frame gets one byte per frame.
+void stm32_CAN_select_node( stm32_session *s, int node ) {
 	int i;
-	for (i=1; i<8; i++) msg.DATA[i]=0;
-	msg.LEN=1;
-	msg.ID=0;
-	msg.MSGTYPE=MSGTYPE_STANDARD;
 
-	/* Fire!
-	 * Write blocks until a tx queue slot is found empty or an error occurred. */
-	ret = CAN_Write(h, &msg);
-	if (ret != 0 ) fprintf( stderr, "CAN transmission error.\n" );
+	if (node == STM32_CAN_ALL_NODES || s->can_nnodes == 0) {
+		s->can_txid = STM32_CAN_ID_BROADCAST;
+		s->can_rxsel = &s->can_rx[ 0 ];
+		s->can_sel = 0;
+	}
+	else {
+		s->can_txid = STM32_CAN_ID_TO_NODE(s->can_nodes[node]);
+		s->can_rxsel = &s->can_rx[ node + 1 ];
+		s->can_sel = node + 1;
+	}
+	s->can_framed = s->can_node_framed[ s->can_sel ];
+	s->can_fd = s->can_node_fd[ s->can_sel ];
+	if (s->can_sel == 0 && s->can_nnodes > 0) {
+		s->can_framed = s->can_fd = 1;
+		for (i=0; i<s->can_nnodes; i++) {
+			s->can_framed &= s->can_node_framed[ i + 1 ];
+			s->can_fd &= s->can_node_fd[ i + 1 ];
+		}
+	}
+}
 
-	/* Fetch various CAN statistics. */
-	/*
-	LINUX_CAN_Statistics( h, &stats);
-	//if (stats.dwErrorCounter!=0) fprintf( stderr, "CAN error occurred somewhen.\n" );
-	printf("                          writes count %d.\n", stats.dwWriteCounter );
-	*/
+// Helper: collect one ACK from every node in mask within timeout us, return the mask of
+// the nodes that ACKed. Nodes that NACKed or timed out are left out.
+static u32 stm32h_CANcollect_acks( stm32_session *s, u32 mask, u32 timeout ) {
+	struct timeval start, now;
+	u32 acked = 0, elapsed;
+	int i;
 
+	gettimeofday( &start, NULL );
+	for (i=0; i<s->can_nnodes; i++) {
+		if (!(mask & (1 << i))) continue;
+		gettimeofday( &now, NULL );
+		elapsed = ( now.tv_sec - start.tv_sec ) * 1000000 + ( now.tv_usec - start.tv_usec );
+		if (stm32h_CANread_ring_byte(s, &s->can_rx[ i + 1 ], elapsed < timeout ? timeout - elapsed : 0) == STM32_COMM_ACK)
+			acked |= 1 << i;
+	}
+	return acked;
 }
 
 void delay(int a) {
@@ -221,96 +412,199 @@ void delay(int a) {
 // ****************************************************************************
 // Implementation of the protocol
 
-int stm32_CAN_init () {
-	DWORD ret;
-	ret = CAN_Init(h, CAN_BAUD_1M , CAN_INIT_TYPE_ST);
+// Set up a session before stm32_init
+void stm32_session_init( stm32_session *s, int devselection, u32 baseaddress )
+{
+  memset( s, 0, sizeof( stm32_session ) );
+  s->devselection = devselection;
+  s->baseaddress = baseaddress;
+  s->ser_id = ( ser_handler )-1;
+  s->can_id = NULL;
+  s->can_txid = STM32_CAN_ID_BROADCAST;
+  s->can_rxsel = &s->can_rx[ 0 ];
+  s->prev_low_latency = s->prev_latency_timer = -1;
+}
+
+// Release the session port
+void stm32_close( stm32_session *s )
+{
+  // The latency settings outlive the port, put them back first
+  if( s->prev_low_latency != -1 && s->ser_id != ( ser_handler )-1 )
+    ser_set_low_latency( ( int )s->ser_id, s->prev_low_latency );
+  if( s->prev_latency_timer != -1 )
+    ser_set_latency_timer( s->portname, s->prev_latency_timer );
+  s->prev_low_latency = s->prev_latency_timer = -1;
+  if( s->ser_id != ( ser_handler )-1 )
+    ser_close( s->ser_id );
+  if( s->can_id )
+    canif_close( s->can_id );
+  if( s->journal )
+    fclose( s->journal );
+  s->ser_id = ( ser_handler )-1;
+  s->can_id = NULL;
+  s->journal = NULL;
+}
+
+int stm32_CAN_init( stm32_session *s ) {
+	return canif_setup(s->can_id, STM32_CAN_BITRATE) == CANIF_OK ? STM32_OK : STM32_INIT_ERROR;
 }
 
-int stm32_init( const char *portname, u32 baud )
+int stm32_init( stm32_session *s, const char *portname, u32 baud )
 {
-  if (devselection == CAN) {
+  int res;
 
-	  printf( "\nhost: opening Peak CAN driver now");
+  if (s->devselection == CAN) {
 
-	  // Open port and assign it to HANDLE h
-	  h = LINUX_CAN_Open( portname , O_RDWR);
-	  if (h==NULL) fprintf(stderr,"\nhost: Peak CAN driver open fail");
+	  STM32_LOG( STM32_LOG_PROGRESS, "\nhost: opening CAN port %s now", portname);
+
+	  // Open port (PEAK driver for /dev/pcan*, SocketCAN interface otherwise)
+	  if( ( s->can_id = canif_open( portname ) ) == NULL )
+		return STM32_PORT_OPEN_ERROR;
 
 	  // Setup port
-	  stm32_CAN_init();
+	  if( stm32_CAN_init( s ) != STM32_OK )
+		return STM32_INIT_ERROR;
+
+	  // FD frames must be accepted by the interface before asking the bootloader
+	  if( s->canfdselection && canif_enable_fd( s->can_id ) != CANIF_OK )
+		fprintf( stderr, "\nhost: CAN FD not available, using classic frames" );
   }
 
-  else if (devselection == USART) {
+  else if (s->devselection == USART) {
 	  // Open port
-	  if( ( stm32_ser_id = ser_open( portname ) ) == ( ser_handler )-1 )
+	  if( ( s->ser_id = ser_open( portname ) ) == ( ser_handler )-1 )
 		return STM32_PORT_OPEN_ERROR;
 
 	  // Setup port
-	  ser_setup( stm32_ser_id, baud, SER_DATABITS_8, SER_PARITY_NONE, SER_STOPBITS_1 );
+	  if( ser_setup( s->ser_id, baud, SER_DATABITS_8, SER_PARITY_NONE, SER_STOPBITS_1 ) != SER_OK )
+		return STM32_INIT_ERROR;
+	  s->baud = baud;
+
+	  // Reset into the bootloader: BOOT0 high (RTS) during an NRST pulse (DTR).
+	  // The init bytes are retried until the bootloader is up.
+	  if( s->reset )
+	  {
+		if( ser_set_lines( s->ser_id, 1, 1 ) != SER_OK )
+		  fprintf( stderr, "\nhost: cannot drive DTR/RTS on %s, no reset", portname );
+		else
+		{
+		  usleep( STM32_RESET_PULSE );
+		  ser_set_lines( s->ser_id, 0, 1 );
+		}
+	  }
   }
+  s->portname = portname;
 
   // Connect to bootloader
-  return stm32h_connect_to_bl();
+  if (s->devselection == CAN && s->can_nnodes > 0) {
+	  // Multicast mode: connect every node on its own ID
+	  int i;
+	  for (i=0; i<s->can_nnodes; i++) {
+		  stm32_CAN_select_node( s, i);
+		  if ((res = stm32h_connect_to_bl( s )) != STM32_OK) {
+			  fprintf(stderr, "\nhost: node %d does not answer", s->can_nodes[i]);
+			  return res;
+		  }
+	  }
+	  stm32_CAN_select_node( s, STM32_CAN_ALL_NODES);
+	  return STM32_OK;
+  }
+  if( ( res = stm32h_connect_to_bl( s ) ) == STM32_OK && s->reset )
+	  ser_set_lines( s->ser_id, 0, 0 ); // BOOT0 low again, the next reset starts the application
+  return res;
 }
 
-// Get bootloader version
-// Expected response: ACK version OPTION1 OPTION2 ACK
-int stm32_get_version( u8 *major, u8 *minor )
+// Get bootloader version and the list of supported commands
+// Expected response: ACK N version cmd1 ... cmdN ACK
+int stm32_get_version( stm32_session *s, u8 *major, u8 *minor )
 {
-  u8 i, version;
+  u8 i;
   int temp, total;
-  int tries = STM32_RETRY_COUNT;
-
-  if (devselection == USART) {
 
+  if (s->devselection == USART) {
 	  STM32_CHECK_INIT;
-	  stm32h_send_command( STM32_CMD_GET_COMMAND );
-	  STM32_EXPECT( STM32_COMM_ACK );
-	  STM32_READ_AND_CHECK( total );
-	  for( i = 0; i < total + 1; i ++ )
-	  {
-		STM32_READ_AND_CHECK( temp );
-		if( i == 0 )
-		  version = ( u8 )temp;
-	  }
-	  *major = version >> 4;
-	  *minor = version & 0x0F;
-	  STM32_EXPECT( STM32_COMM_ACK );
-	  return STM32_OK;
   }
-
-  else if (devselection == CAN) {
-
-	  stm32h_send_command( STM32_CMD_GET_COMMAND );
-	  printf("\nhost: get command sent");
-	  STM32_EXPECT( STM32_COMM_ACK );
-	  printf("\nhost: first ack received");
-	  STM32_READ_AND_CHECK( total );
-	  for( i = 0; i < total + 1; i ++ )
-	  {
-	     STM32_READ_AND_CHECK( temp );
-	     if( i == 0 )
-	     version = ( u8 )temp;
-	  }
-	  *major = version >> 4;
-	  *minor = version & 0x0F;
-	  STM32_EXPECT( STM32_COMM_ACK );
-	  printf("\nhost: second ack received");
-	  return STM32_OK;
+  stm32h_send_command( s, STM32_CMD_GET_COMMAND );
+  STM32_LOG( STM32_LOG_PROTOCOL, "\nhost: get command sent");
+  STM32_EXPECT( STM32_COMM_ACK );
+  STM32_LOG( STM32_LOG_PROTOCOL, "\nhost: first ack received");
+  STM32_READ_AND_CHECK( total );
+  STM32_READ_AND_CHECK( temp );
+  s->bl_version = ( u8 )temp;
+  s->ncaps = 0;
+  for( i = 0; i < total; i ++ )
+  {
+    STM32_READ_AND_CHECK( temp );
+    if( s->ncaps < STM32_MAX_CAPS )
+      s->caps[ s->ncaps ++ ] = ( u8 )temp;
   }
+  *major = s->bl_version >> 4;
+  *minor = s->bl_version & 0x0F;
+  STM32_EXPECT( STM32_COMM_ACK );
+  STM32_LOG( STM32_LOG_PROTOCOL, "\nhost: second ack received");
+
+  // Older CBBL builds do not list the framing commands and stay at one byte per frame
+  if (s->devselection == CAN)
+	  return stm32h_CANnegotiate(s);
+  return STM32_OK;
+}
 
-  return STM32_COMM_ERROR;
+// Check if the bootloader listed the given command in the GET reply
+int stm32_has_cap( stm32_session *s, u8 cmd )
+{
+  int i;
+
+  for( i = 0; i < s->ncaps; i ++ )
+    if( s->caps[ i ] == cmd )
+      return 1;
+  return 0;
+}
 
+// Print the commands listed by the bootloader
+void stm32_dump_caps( stm32_session *s )
+{
+  static const struct { u8 cmd; const char *name; } names[] =
+  {
+    { STM32_CMD_GET_COMMAND, "get" },
+    { 0x01, "get version and protection status" },
+    { STM32_CMD_GET_ID, "get ID" },
+    { STM32_CMD_READ_FLASH, "read memory" },
+    { STM32_CMD_GO, "go" },
+    { STM32_CMD_WRITE_FLASH, "write memory" },
+    { STM32_CMD_ERASE_FLASH, "erase" },
+    { STM32_CMD_EXT_ERASE_FLASH, "extended erase" },
+    { 0x63, "write protect" },
+    { STM32_CMD_WRITE_UNPROTECT, "write unprotect" },
+    { 0x82, "readout protect" },
+    { 0x92, "readout unprotect" },
+    { STM32_CMD_CAN_FRAMING, "CBBL multi-byte CAN frames" },
+    { STM32_CMD_CAN_FD, "CBBL CAN FD bulk transfers" },
+    { STM32_CMD_ERASE_ASYNC, "CBBL background page erase" },
+    { STM32_CMD_WRITE_EXT, "CBBL extended write memory" },
+    { STM32_CMD_WRITE_WINDOW, "CBBL windowed write memory" },
+    { STM32_CMD_CRC, "CBBL CRC-32 check" },
+    { STM32_CMD_SET_BAUD, "CBBL baud rate switch" }
+  };
+  int i, j;
+
+  printf( "host: bootloader version %d.%d, %d commands\n", s->bl_version >> 4, s->bl_version & 0x0F, s->ncaps );
+  for( i = 0; i < s->ncaps; i ++ )
+  {
+    for( j = 0; j < ( int )( sizeof( names ) / sizeof( names[ 0 ] ) ); j ++ )
+      if( names[ j ].cmd == s->caps[ i ] )
+        break;
+    printf( "\t0x%02X %s\n", s->caps[ i ], j < ( int )( sizeof( names ) / sizeof( names[ 0 ] ) ) ? names[ j ].name : "unknown" );
+  }
 }
 
 // Get chip ID
-int stm32_get_chip_id( u16 *version )
+int stm32_get_chip_id( stm32_session *s, u16 *version )
 {
   int vh, vl;
 
-  if (devselection == USART) {
+  if (s->devselection == USART) {
 	  STM32_CHECK_INIT;
-	  stm32h_send_command( STM32_CMD_GET_ID );
+	  stm32h_send_command( s, STM32_CMD_GET_ID );
 	  STM32_EXPECT( STM32_COMM_ACK );
 	  STM32_EXPECT( 1 );
 	  STM32_READ_AND_CHECK( vh );
@@ -320,9 +614,9 @@ int stm32_get_chip_id( u16 *version )
 	  return STM32_OK;
   }
 
-  else if (devselection == CAN) {
+  else if (s->devselection == CAN) {
 
-	  stm32h_send_command( STM32_CMD_GET_ID );
+	  stm32h_send_command( s, STM32_CMD_GET_ID );
 	  STM32_EXPECT( STM32_COMM_ACK );
 	  STM32_EXPECT( 1 );
 	  STM32_READ_AND_CHECK( vh );
@@ -337,39 +631,39 @@ int stm32_get_chip_id( u16 *version )
 }
 
 // Write unprotect
-int stm32_write_unprotect()
+int stm32_write_unprotect( stm32_session *s )
 {
-	if (devselection == USART) {
+	if (s->devselection == USART) {
 
-		printf("\nhost: starting write unprotect sequence");
+		STM32_LOG( STM32_LOG_PROTOCOL, "\nhost: starting write unprotect sequence");
 		STM32_CHECK_INIT;
 		//printf("\n\thost: CHECK_INIT succeded");
-		stm32h_send_command( STM32_CMD_WRITE_UNPROTECT );
+		stm32h_send_command( s, STM32_CMD_WRITE_UNPROTECT );
 		//printf("\n\thost: write unprotect command sent, waiting for acks");
 		STM32_EXPECT( STM32_COMM_ACK );
-		printf("\n\thost: ack received (write unprotect request)");
+		STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (write unprotect request)");
 		STM32_EXPECT( STM32_COMM_ACK );
-		printf("\n\thost: ack received (Flash unprotected successfully)");
-		printf("\n\thost: reinitializing due to device reset");
+		STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (Flash unprotected successfully)");
+		STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: reinitializing due to device reset");
 		// At this point the system got a reset, so we need to re-enter BL mode
 		//delay(99);
-		return stm32h_connect_to_bl();
+		return stm32h_connect_to_bl( s );
 
 	}
 
-	else if (devselection == CAN) {
+	else if (s->devselection == CAN) {
 
-		printf("\nhost: starting write unprotect sequence");
-		stm32h_send_command( STM32_CMD_WRITE_UNPROTECT );
+		STM32_LOG( STM32_LOG_PROTOCOL, "\nhost: starting write unprotect sequence");
+		stm32h_send_command( s, STM32_CMD_WRITE_UNPROTECT );
 		//printf("\n\thost: write unprotect command sent, waiting for acks");
 		STM32_EXPECT( STM32_COMM_ACK );
-		printf("\n\thost: ack received (write unprotect request)");
+		STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (write unprotect request)");
 		STM32_EXPECT( STM32_COMM_ACK );
-		printf("\n\thost: ack received (Flash unprotected successfully)");
-		printf("\n\thost: reinitializing due to device reset");
+		STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (Flash unprotected successfully)");
+		STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: reinitializing due to device reset");
 		// At this point the system got a reset, so we need to re-enter BL mode
 		//delay(99);
-		return stm32h_connect_to_bl();
+		return stm32h_connect_to_bl( s );
 
 	}
 
@@ -377,55 +671,55 @@ int stm32_write_unprotect()
 }
 
 // Erase flash
-int stm32_erase_flash()
+int stm32_erase_flash( stm32_session *s )
 {
   int cbbltest;
 
-  if (devselection == USART) {
+  if (s->devselection == USART) {
 
 	  STM32_CHECK_INIT;
-	  printf("\nhost: starting erase flash sequence");
+	  STM32_LOG( STM32_LOG_PROTOCOL, "\nhost: starting erase flash sequence");
 	  //delay(9);
-	  stm32h_send_command( STM32_CMD_ERASE_FLASH );
-	  cbbltest = stm32h_read_byte();
-	  printf("\n\thost: received value %x", cbbltest);
+	  stm32h_send_command( s, STM32_CMD_ERASE_FLASH );
+	  cbbltest = stm32h_read_byte( s );
+	  STM32_LOG( STM32_LOG_TRACE, "\n\thost: received value %x", cbbltest);
 	  if(cbbltest != STM32_COMM_ACK) return STM32_COMM_ERROR;
 	  //delay(9);
-	  printf("\n\thost: ack received (erase memory request)");
-	  ser_write_byte( stm32_ser_id, 0xFF );
-	  //ser_write_byte( stm32_ser_id, 0x00 );
+	  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (erase memory request)");
+	  ser_write_byte( s->ser_id, 0xFF );
+	  //ser_write_byte( s->ser_id, 0x00 );
 	  delay(99);
-	  cbbltest = stm32h_read_byte();
+	  cbbltest = stm32h_read_byte( s );
 	  /*
 	  if (cbbltest == -1) printf("\n\tread byte failed, %x, %d", cbbltest, cbbltest);
 	  else printf("\n\thost: received value %x, %d", cbbltest, cbbltest);
 	  */
 	  if(cbbltest != STM32_COMM_ACK) return STM32_COMM_ERROR;
-	  printf("\n\thost: ack received (erase procedure successful)");
+	  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (erase procedure successful)");
 	  return STM32_OK;
   }
 
-  else if (devselection == CAN) {
+  else if (s->devselection == CAN) {
 
-	  printf("\nhost: starting erase flash sequence");
+	  STM32_LOG( STM32_LOG_PROTOCOL, "\nhost: starting erase flash sequence");
 	  //delay(9);
-	  stm32h_send_command( STM32_CMD_ERASE_FLASH );
-	  cbbltest = stm32h_read_byte();
-	  printf("\n\thost: received value %x", cbbltest);
+	  stm32h_send_command( s, STM32_CMD_ERASE_FLASH );
+	  cbbltest = stm32h_read_byte( s );
+	  STM32_LOG( STM32_LOG_TRACE, "\n\thost: received value %x", cbbltest);
 	  if(cbbltest != STM32_COMM_ACK) return STM32_COMM_ERROR;
 	  //delay(9);
-	  printf("\n\thost: ack received (erase memory request)");
-	  stm32h_send_byte( stm32_ser_id, 0xFF );
-	  //ser_write_byte( stm32_ser_id, 0xFF );
-	  //ser_write_byte( stm32_ser_id, 0x00 );
+	  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (erase memory request)");
+	  stm32h_send_byte( s, 0xFF );
+	  //ser_write_byte( s->ser_id, 0xFF );
+	  //ser_write_byte( s->ser_id, 0x00 );
 	  delay(99);
-	  cbbltest = stm32h_read_byte();
+	  cbbltest = stm32h_read_byte( s );
 	  /*
 	  if (cbbltest == -1) printf("\n\tread byte failed, %x, %d", cbbltest, cbbltest);
 	  else printf("\n\thost: received value %x, %d", cbbltest, cbbltest);
 	  */
 	  if(cbbltest != STM32_COMM_ACK) return STM32_COMM_ERROR;
-	  printf("\n\thost: ack received (erase procedure successful)");
+	  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (erase procedure successful)");
 	  return STM32_OK;
   }
 
@@ -433,18 +727,662 @@ int stm32_erase_flash()
 
 }
 
+// Pages covered by size bytes starting at address
+// Returns STM32_OK, or STM32_COMM_ERROR if the range is outside the flash or
+// does not start on a page boundary (erasing the first page would wipe the
+// bytes below address)
+int stm32_flash_pages( u32 address, u32 size, u32 *first, u32 *count )
+{
+  u32 last;
+
+  if( size == 0 || address < STM32_FLASH_BASE || ( address - STM32_FLASH_BASE ) % STM32_FLASH_PAGES_SIZE )
+    return STM32_COMM_ERROR;
+  *first = ( address - STM32_FLASH_BASE ) / STM32_FLASH_PAGES_SIZE;
+  last = ( address + size - 1 - STM32_FLASH_BASE ) / STM32_FLASH_PAGES_SIZE;
+  if( last >= STM32_FLASH_PAGES_NUM )
+    return STM32_COMM_ERROR;
+  *count = last - *first + 1;
+  return STM32_OK;
+}
+
+// Erase the given pages (page-list form of the erase command:
+// number of pages - 1, the page numbers, checksum). Bootloaders that list
+// the extended erase take the same list with 16 bit fields instead.
+int stm32_erase_page_list( stm32_session *s, const u8 *pages, u32 count )
+{
+  u8 buf[ 2 * STM32_FLASH_PAGES_NUM + 2 ];
+  u32 i, len;
+  int res = -1;
+
+  if( count == 0 || count > STM32_FLASH_PAGES_NUM )
+    return STM32_COMM_ERROR;
+  STM32_LOG( STM32_LOG_PROTOCOL, "\nhost: erasing %lu pages", count );
+  if( stm32_has_cap( s, STM32_CMD_EXT_ERASE_FLASH ) )
+  {
+    stm32h_send_command( s, STM32_CMD_EXT_ERASE_FLASH );
+    buf[ 0 ] = ( u8 )( ( count - 1 ) >> 8 );
+    buf[ 1 ] = ( u8 )( count - 1 );
+    for( i = 0; i < count; i ++ )
+    {
+      buf[ 2 + 2 * i ] = 0;
+      buf[ 3 + 2 * i ] = pages[ i ];
+    }
+    len = 2 * count + 2;
+  }
+  else
+  {
+    stm32h_send_command( s, STM32_CMD_ERASE_FLASH );
+    buf[ 0 ] = ( u8 )( count - 1 );
+    memcpy( buf + 1, pages, count );
+    len = count + 1;
+  }
+  STM32_EXPECT( STM32_COMM_ACK );
+  stm32h_send_packet_with_checksum( s, buf, len );
+  // The ACK comes once every page is erased
+  for( i = 0; i <= count * STM32_FLASH_PAGE_ERASE_TIME / STM32_COMM_TIMEOUT && res == -1; i ++ )
+    res = stm32h_read_byte( s );
+  if( res != STM32_COMM_ACK )
+    return STM32_COMM_ERROR;
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (pages erased)" );
+  return STM32_OK;
+}
+
+// Erase count pages starting from first
+int stm32_erase_pages( stm32_session *s, u32 first, u32 count )
+{
+  u8 pages[ STM32_FLASH_PAGES_NUM ];
+  u32 i;
+
+  if( count == 0 || first + count > STM32_FLASH_PAGES_NUM )
+    return STM32_COMM_ERROR;
+  for( i = 0; i < count; i ++ )
+    pages[ i ] = ( u8 )( first + i );
+  return stm32_erase_page_list( s, pages, count );
+}
+
+// Helper: start erasing a page in the background (CBBL extension).
+// The bootloader ACKs as soon as the erase starts and holds the following
+// writes to that page until it is done.
+static int stm32h_erase_page_async( stm32_session *s, u32 page )
+{
+  u8 p = ( u8 )page;
+
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: erasing page %lu in the background", page );
+  stm32h_send_command( s, STM32_CMD_ERASE_ASYNC );
+  STM32_EXPECT( STM32_COMM_ACK );
+  stm32h_send_packet_with_checksum( s, &p, 1 );
+  STM32_EXPECT( STM32_COMM_ACK );
+  return STM32_OK;
+}
+
+// Helper: check if a block is all 0xFF (the erased flash state)
+static int stm32h_block_erased( const u8 *data, u32 len )
+{
+  u32 i;
+
+  for( i = 0; i < len; i ++ )
+    if( data[ i ] != 0xFF )
+      return 0;
+  return 1;
+}
+
+// Largest write block the bootloader takes: a flash page (or the requested
+// block size) with the extended write, STM32_WRITE_BUFSIZE otherwise
+u32 stm32_write_blocksize( stm32_session *s )
+{
+  if( !stm32_has_cap( s, STM32_CMD_WRITE_EXT ) )
+    return s->blocksize && s->blocksize < STM32_WRITE_BUFSIZE ? s->blocksize : STM32_WRITE_BUFSIZE;
+  if( s->blocksize == 0 )
+    return STM32_FLASH_PAGES_SIZE;
+  return s->blocksize < STM32_WRITE_EXT_MAXSIZE ? s->blocksize : STM32_WRITE_EXT_MAXSIZE;
+}
+
+// Helper: the write command for a block, the extended one above 256 bytes
+static u8 stm32h_write_command( u32 datalen )
+{
+  return datalen > STM32_WRITE_BUFSIZE ? STM32_CMD_WRITE_EXT : STM32_CMD_WRITE_FLASH;
+}
+
+// Helper: send the data phase of a write, length (1 byte, or 2 bytes MSB
+// first for the extended write) + data + checksum. The data starts at
+// data + STM32_WRITE_HDRSIZE, the length goes in the bytes before it.
+static int stm32h_send_write_data( stm32_session *s, u8 *data, u32 datalen )
+{
+  if( datalen > STM32_WRITE_BUFSIZE )
+  {
+    data[ 0 ] = ( u8 )( ( datalen - 1 ) >> 8 );
+    data[ 1 ] = ( u8 )( datalen - 1 );
+    return stm32h_send_packet_with_checksum( s, data, datalen + 2 );
+  }
+  data[ 1 ] = ( u8 )( datalen - 1 );
+  return stm32h_send_packet_with_checksum( s, data + 1, datalen + 1 );
+}
+
+// Helper: seconds to send one byte on the link
+static double stm32h_byte_time( stm32_session *s )
+{
+  if( s->devselection == USART )
+    return s->baud ? 10.0 / s->baud : 0;
+  // About 130 bits for a full classic frame, 50 for a one byte frame
+  return ( s->can_framed ? 130.0 / STM32_CAN_MAX_DLEN : 50.0 ) / STM32_CAN_BITRATE;
+}
+
+// Helper: us to wait for a write ACK once len bytes went out, datalen of
+// them to program. A lost ACK costs about one block time instead of
+// STM32_COMM_TIMEOUT, which stays for the erase commands.
+static u32 stm32h_ack_timeout( stm32_session *s, u32 len, u32 datalen )
+{
+  return ( u32 )( len * stm32h_byte_time( s ) * 1000000 ) + datalen * STM32_PROGRAM_TIME / 1024 + STM32_ACK_TIMEOUT;
+}
+
+// Helper: write one block (datalen bytes at data + STM32_WRITE_HDRSIZE) at the given address
+static int stm32h_write_block( stm32_session *s, u32 address, u8 *data, u32 datalen )
+{
+  int cbbltest;
+
+  // Send write request
+  //delay(9);
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: sending write request command, 0x%02X", stm32h_write_command( datalen ));
+  stm32h_send_command( s, stm32h_write_command( datalen ) );
+  if( stm32h_read_byte_timeout( s, stm32h_ack_timeout( s, 2, 0 ) ) != STM32_COMM_ACK )
+    return STM32_COMM_ERROR;
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (write request ack)");
+
+  // Send address
+  //delay(9);
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: sending address: %lx", address);
+  stm32h_send_address( s, address );
+  if( stm32h_read_byte_timeout( s, stm32h_ack_timeout( s, 5, 0 ) ) != STM32_COMM_ACK )
+    return STM32_COMM_ERROR;
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (address ok)");
+
+  // Send data
+  //delay(9);
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: sending data...");
+  stm32h_send_write_data( s, data, datalen );
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: data sent... now waiting for ack");
+  //delay(9);
+  cbbltest = stm32h_read_byte_timeout( s, stm32h_ack_timeout( s, datalen + 3, datalen ) );
+  if (cbbltest == -1) STM32_LOG( STM32_LOG_TRACE, "\n\tread byte failed, %x, %d", cbbltest, cbbltest);
+  if(cbbltest != STM32_COMM_ACK) {
+  	STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack not received, instead I received %x",cbbltest);
+  	return STM32_COMM_ERROR;
+  }
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (data packet ok)");
+  return STM32_OK;
+}
+
+// Helper: read a byte, waiting at most timeout us
+static int stm32h_read_byte_timeout( stm32_session *s, u32 timeout )
+{
+  int b;
+
+  if (s->devselection == CAN)
+	  return stm32h_CANread_ring_byte( s, s->can_rxsel, timeout );
+  ser_set_timeout_ms( s->ser_id, timeout );
+  b = stm32h_read_byte( s );
+  ser_set_timeout_ms( s->ser_id, STM32_COMM_TIMEOUT );
+  return b;
+}
+
+// Helper: get back in step with the bootloader after a failed transaction.
+// A device still waiting for the rest of a packet (lost or corrupted bytes)
+// gets a filler as long as the longest packet: the packet fails its checksum
+// and the rest of the filler is taken as invalid commands, all NACKed. Then
+// 0xFF is sent until a NACK comes back, which leaves the device waiting for a
+// command whatever number of filler bytes it swallowed. Between attempts the
+// link stays idle for a backoff that doubles every time.
+// Returns 1 once the NACK came back, 0 if the device did not answer.
+static int stm32h_resync( stm32_session *s, int attempt )
+{
+  u8 filler[ STM32_WINDOW_HDRSIZE + STM32_WRITE_EXT_MAXSIZE + 1 ];
+  u32 len = STM32_WINDOW_HDRSIZE + stm32_write_blocksize( s ) + 1;
+  u32 backoff = STM32_RETRY_BACKOFF << ( attempt < 6 ? attempt : 6 );
+  int i;
+
+  usleep( backoff );
+  memset( filler, 0xFF, len );
+  if (s->devselection == USART)
+	  ser_write( s->ser_id, filler, len );
+  else if (s->devselection == CAN)
+	  stm32h_CANwrite_bulk( s, filler, len );
+
+  // Drop the NACKs and whatever late reply is still coming
+  while( stm32h_read_byte_timeout( s, backoff ) != -1 );
+  for( i = 0; i < 3; i ++ )
+  {
+    stm32h_send_byte( s, 0xFF );
+    if( stm32h_read_byte_timeout( s, backoff ) == STM32_COMM_NACK )
+      return 1;
+  }
+  return 0;
+}
+
+// Helper: read memory until two reads in a row agree. The data sent back
+// has no checksum, a bit error would be taken for the FLASH contents.
+static int stm32h_read_memory_twice( stm32_session *s, u32 address, u8 *dst, u32 len )
+{
+  u8 again[ STM32_WRITE_EXT_MAXSIZE + 2 * STM32_FLASH_PAGES_SIZE ];
+  int tries;
+
+  if( len > sizeof( again ) || stm32_read_memory( s, address, dst, len ) != STM32_OK )
+    return STM32_COMM_ERROR;
+  for( tries = 0; tries < STM32_RETRY_COUNT; tries ++ )
+  {
+    if( stm32_read_memory( s, address, again, len ) != STM32_OK )
+      return STM32_COMM_ERROR;
+    if( memcmp( dst, again, len ) == 0 )
+      return STM32_OK;
+    memcpy( dst, again, len );
+  }
+  return STM32_COMM_ERROR;
+}
+
+// Helper: after a write that got no ACK, find out what the device did with
+// the block before it is sent again. Flash cannot be programmed twice (PGERR
+// on the STM32F1), so a block already on the device (only its ACK was lost)
+// is taken as written, and a block partly programmed has its pages erased
+// with the rest of their contents read back and written again.
+// Returns 1 if the block is on the device, 0 if it can be written again,
+// -1 if the device could not be checked.
+static int stm32h_check_block( stm32_session *s, u32 address, const u8 *data, u32 datalen )
+{
+  u8 span[ STM32_WRITE_EXT_MAXSIZE + 2 * STM32_FLASH_PAGES_SIZE ];
+  u8 block[ STM32_WRITE_HDRSIZE + STM32_WRITE_EXT_MAXSIZE ];
+  u8 pages[ 3 ];
+  u32 first, last, start, size, from, len, blocksize = stm32_write_blocksize( s );
+  u32 i;
+
+  // The bootloader CRC saves reading the block back when it is there
+  if( stm32_has_cap( s, STM32_CMD_CRC ) && stm32_verify_crc( s, address, data, datalen ) == STM32_OK )
+    return 1;
+
+  first = ( address - STM32_FLASH_BASE ) / STM32_FLASH_PAGES_SIZE;
+  last = ( address + datalen - 1 - STM32_FLASH_BASE ) / STM32_FLASH_PAGES_SIZE;
+  start = STM32_FLASH_BASE + first * STM32_FLASH_PAGES_SIZE;
+  size = ( last - first + 1 ) * STM32_FLASH_PAGES_SIZE;
+  if( address < STM32_FLASH_BASE || last >= STM32_FLASH_PAGES_NUM ||
+      stm32h_read_memory_twice( s, address, span, datalen ) != STM32_OK )
+    return -1;
+  if( memcmp( span, data, datalen ) == 0 )
+  {
+    STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: block at %lx is on the device, its ACK was lost", address );
+    return 1;
+  }
+  if( stm32h_block_erased( span, datalen ) )
+    return 0;
+
+  // Partly programmed: erase its pages, keep everything else they hold
+  STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: block at %lx partly programmed, rewriting pages %lu to %lu", address, first, last );
+  if( stm32h_read_memory_twice( s, start, span, size ) != STM32_OK )
+    return -1;
+  for( i = first; i <= last; i ++ )
+    pages[ i - first ] = ( u8 )i;
+  if( stm32_erase_page_list( s, pages, last - first + 1 ) != STM32_OK )
+    return -1;
+  for( from = 0; from < size; from += len )
+  {
+    // Up to the block, then from its end
+    if( start + from >= address && start + from < address + datalen )
+    {
+      len = address + datalen - start - from;
+      continue;
+    }
+    len = start + from < address ? address - start - from : size - from;
+    if( len > blocksize )
+      len = blocksize;
+    memcpy( block + STM32_WRITE_HDRSIZE, span + from, len );
+    if( !stm32h_block_erased( block + STM32_WRITE_HDRSIZE, len ) &&
+        stm32h_write_block_retry( s, start + from, block, len ) != STM32_OK )
+      return -1;
+  }
+  return 0;
+}
+
+// Helper: write one block, again (up to STM32_RETRY_COUNT times in all)
+// until the device ACKs it
+static int stm32h_write_block_retry( stm32_session *s, u32 address, u8 *data, u32 datalen )
+{
+  int tries;
+
+  for( tries = 0; tries < STM32_RETRY_COUNT; tries ++ )
+  {
+    if( tries > 0 )
+    {
+      s->retries ++;
+      stm32h_resync( s, tries - 1 );
+      if( stm32h_check_block( s, address, data + STM32_WRITE_HDRSIZE, datalen ) == 1 )
+        return STM32_OK;
+      STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: writing block at %lx again (try %d)", address, tries + 1 );
+    }
+    if( stm32h_write_block( s, address, data, datalen ) == STM32_OK )
+      return STM32_OK;
+    s->errors ++;
+  }
+  fprintf( stderr, "\nhost: write failed at %lx after %d tries\n", address, tries );
+  return STM32_COMM_ERROR;
+}
+
+// Helper: report the errors and retries since the given counter values
+static void stm32h_retry_report( stm32_session *s, u32 errors, u32 retries )
+{
+  if( s->errors != errors || s->retries != retries )
+    STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: %lu failed transactions, %lu blocks sent or read again",
+        s->errors - errors, s->retries - retries );
+}
+
+// Helper: write one block to all the live nodes at once (CAN multicast mode)
+// The block is broadcast once, each node ACKs every phase on its own ID. A node
+// that NACKs ignores the rest of the broadcast transaction (CBBL node addressing),
+// so the nodes that NACKed or timed out get the block again by unicast.
+// Returns the mask of the nodes still alive.
+static u32 stm32h_CANwrite_block_mcast( stm32_session *s, u32 alive, u32 address, u8 *data, u32 datalen )
+{
+  u32 ok = alive;
+  int i, tries;
+
+  stm32_CAN_select_node( s, STM32_CAN_ALL_NODES );
+  stm32h_send_command( s, stm32h_write_command( datalen ) );
+  ok = stm32h_CANcollect_acks( s, ok, stm32h_ack_timeout( s, 2, 0 ) );
+  if( ok )
+  {
+    stm32h_send_address( s, address );
+    ok = stm32h_CANcollect_acks( s, ok, stm32h_ack_timeout( s, 5, 0 ) );
+  }
+  if( ok )
+  {
+    stm32h_send_write_data( s, data, datalen );
+    ok = stm32h_CANcollect_acks( s, ok, stm32h_ack_timeout( s, datalen + 3, datalen ) );
+  }
+
+  // Retransmit only to the nodes that failed
+  for( i = 0; i < s->can_nnodes; i ++ )
+  {
+    if( !( alive & ~ok & ( 1 << i ) ) )
+      continue;
+    stm32_CAN_select_node( s, i );
+    s->errors ++;
+    for( tries = 0; tries < STM32_RETRY_COUNT; tries ++ )
+    {
+      // Drop whatever late ACK/NACK the node sent for the broadcast attempt,
+      // the node may have programmed the block with only its ACK lost
+      stm32h_resync( s, tries );
+      if( stm32h_check_block( s, address, data + STM32_WRITE_HDRSIZE, datalen ) == 1 )
+      {
+        ok |= 1 << i;
+        break;
+      }
+      s->retries ++;
+      STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: node %d: retransmitting block at %lx", s->can_nodes[ i ], address );
+      if( stm32h_write_block( s, address, data, datalen ) == STM32_OK )
+      {
+        ok |= 1 << i;
+        break;
+      }
+      s->errors ++;
+    }
+    if( !( ok & ( 1 << i ) ) )
+      fprintf( stderr, "\nhost: node %d: write failed at %lx, node dropped\n", s->can_nodes[ i ], address );
+  }
+  stm32_CAN_select_node( s, STM32_CAN_ALL_NODES );
+  return ok;
+}
+
+// Open (or create) the write journal at path. If it holds a record for the
+// same image, chip and base address, confirmed gets the image bytes the
+// device already ACKed, 0 otherwise. stm32_write_flash updates the record.
+int stm32_journal_open( stm32_session *s, const char *path, u32 imagecrc, u32 imagesize, u16 chip_id, u32 *confirmed )
+{
+  char line[ 80 ];
+  unsigned long value;
+  size_t keylen;
+
+  snprintf( s->journal_key, sizeof( s->journal_key ), "%08lX %08lX %04X %08lX", imagecrc, imagesize, chip_id, s->baseaddress );
+  keylen = strlen( s->journal_key );
+  *confirmed = 0;
+  if( ( s->journal = fopen( path, "r+" ) ) != NULL )
+  {
+    if( fgets( line, sizeof( line ), s->journal ) && strncmp( line, s->journal_key, keylen ) == 0 &&
+        sscanf( line + keylen, "%lX", &value ) == 1 && value <= imagesize )
+      *confirmed = value;
+  }
+  else if( ( s->journal = fopen( path, "w" ) ) == NULL )
+    return STM32_COMM_ERROR;
+  return STM32_OK;
+}
+
+// Helper: record the image bytes confirmed by the device. The record has a
+// fixed size and is written over the previous one.
+static void stm32h_journal( stm32_session *s, u32 confirmed )
+{
+  if( s->journal == NULL )
+    return;
+  fseek( s->journal, 0, SEEK_SET );
+  fprintf( s->journal, "%s %08lX\n", s->journal_key, confirmed );
+  fflush( s->journal );
+}
+
+// Windowed write slot: one block in flight
+typedef struct
+{
+  u8 pkt[ STM32_WINDOW_HDRSIZE + STM32_WRITE_EXT_MAXSIZE ]; //header + data
+  u32 address;
+  u32 len; //data bytes
+  int tries;
+  int busy; //sent, not ACKed yet
+} stm32h_window_slot;
+
+// Helper: send a windowed write transaction, the reply comes later
+static int stm32h_send_window_block( stm32_session *s, stm32h_window_slot *slot )
+{
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: sending block %d (%lu bytes)", slot->pkt[ 0 ], slot->len );
+  stm32h_send_command( s, STM32_CMD_WRITE_WINDOW );
+  return stm32h_send_packet_with_checksum( s, slot->pkt, STM32_WINDOW_HDRSIZE + slot->len );
+}
+
+// Helper: send a windowed write transaction again, up to STM32_RETRY_COUNT tries
+static int stm32h_resend_window_block( stm32_session *s, stm32h_window_slot *slot )
+{
+  if( ++ slot->tries >= STM32_RETRY_COUNT )
+  {
+    fprintf( stderr, "\nhost: block at %02X%02X%02X%02X failed %d times\n",
+        slot->pkt[ 1 ], slot->pkt[ 2 ], slot->pkt[ 3 ], slot->pkt[ 4 ], slot->tries );
+    return STM32_COMM_ERROR;
+  }
+  s->retries ++;
+  return stm32h_send_window_block( s, slot );
+}
+
+// Helper: a windowed block is on the device, free its slot and record the
+// image bytes confirmed, everything below the oldest block still in flight
+static void stm32h_window_block_done( stm32_session *s, stm32h_window_slot *slots, stm32h_window_slot *slot,
+    u32 next, u32 *wrote, p_progress progress_func )
+{
+  u32 confirmed = next - s->baseaddress;
+  int i;
+
+  slot->busy = 0;
+  *wrote += slot->len;
+  if( progress_func )
+    progress_func( s->user, *wrote );
+  for( i = 0; i < STM32_WRITE_WINDOW_MAX; i ++ )
+    if( slots[ i ].busy && slots[ i ].address - s->baseaddress < confirmed )
+      confirmed = slots[ i ].address - s->baseaddress;
+  stm32h_journal( s, confirmed );
+}
+
+// Helper: windowed write (CBBL extension). Up to s->window transactions are
+// sent without waiting for the device, each one tagged with a sequence
+// number: seq, address (4 bytes), length - 1 (2 bytes), data, checksum.
+// The device answers ACK/NACK + seq for every one of them, the NACKed
+// blocks are sent again. With STM32_WRITE_WINDOW_AUTO the first block is
+// sent alone and the window covers its round trip time.
+static int stm32h_write_flash_window( stm32_session *s, p_read_data read_data_func, p_progress progress_func )
+{
+  stm32h_window_slot slots[ STM32_WRITE_WINDOW_MAX ];
+  stm32h_window_slot *slot;
+  u32 blocksize = stm32_write_blocksize( s );
+  u32 window = s->window == STM32_WRITE_WINDOW_AUTO ? 1 : s->window;
+  u32 address = s->baseaddress + s->resumeoffset, datalen, inflight = 0;
+  u32 wrote = s->resumeoffset, blocks = 0;
+  u32 errors = s->errors, retries = s->retries;
+  u8 seq = 0, reply[ 2 ];
+  int i, done = 0, tuned = s->window != STM32_WRITE_WINDOW_AUTO;
+  struct timeval start, now;
+  u32 txframes = s->can_txframes, rxframes = s->can_rxframes;
+  u32 txbytes = s->can_txbytes, rxbytes = s->can_rxbytes;
+  u32 rdcalls = 0, wrcalls = 0;
+  double secs, rtt;
+
+  if( window > STM32_WRITE_WINDOW_MAX )
+    window = STM32_WRITE_WINDOW_MAX;
+  memset( slots, 0, sizeof( slots ) );
+  if (s->devselection == USART)
+    ser_get_syscalls( s->ser_id, &rdcalls, &wrcalls );
+  gettimeofday( &start, NULL );
+  STM32_LOG( STM32_LOG_PROGRESS, "\nhost: windowed write of %lu byte blocks from %lx", blocksize, address );
+
+  while( !done || inflight > 0 )
+  {
+    // Fill the window, a slot is reused once its block is ACKed
+    while( !done && inflight < window && !slots[ seq % STM32_WRITE_WINDOW_MAX ].busy )
+    {
+      slot = &slots[ seq % STM32_WRITE_WINDOW_MAX ];
+      if( ( datalen = read_data_func( s->user, slot->pkt + STM32_WINDOW_HDRSIZE, blocksize ) ) == 0 )
+      {
+        done = 1;
+        break;
+      }
+      if( s->sparse && stm32h_block_erased( slot->pkt + STM32_WINDOW_HDRSIZE, datalen ) )
+      {
+        address += datalen;
+        wrote += datalen;
+        continue;
+      }
+      slot->pkt[ 0 ] = seq;
+      slot->pkt[ 1 ] = address >> 24;
+      slot->pkt[ 2 ] = ( address >> 16 ) & 0xFF;
+      slot->pkt[ 3 ] = ( address >> 8 ) & 0xFF;
+      slot->pkt[ 4 ] = address & 0xFF;
+      slot->pkt[ 5 ] = ( u8 )( ( datalen - 1 ) >> 8 );
+      slot->pkt[ 6 ] = ( u8 )( datalen - 1 );
+      slot->address = address;
+      slot->len = datalen;
+      slot->tries = 0;
+      slot->busy = 1;
+      if( stm32h_send_window_block( s, slot ) != STM32_OK )
+        return STM32_COMM_ERROR;
+      inflight ++;
+      blocks ++;
+      seq ++;
+      address += datalen;
+    }
+    if( inflight == 0 )
+      continue;
+
+    // Match the next reply with its block. Without one (or with a garbled
+    // one) the blocks in flight that did not make it to the device are sent
+    // again, the others only lost their replies.
+    slot = NULL;
+    if( stm32h_read_bytes_timeout( s, reply, 2, stm32h_ack_timeout( s, inflight * ( STM32_WINDOW_HDRSIZE + 3 + blocksize ),
+        inflight * blocksize ) ) == 2 )
+    {
+      slot = &slots[ reply[ 1 ] % STM32_WRITE_WINDOW_MAX ];
+      if( !slot->busy || slot->pkt[ 0 ] != reply[ 1 ] )
+        slot = NULL;
+    }
+    if( slot == NULL )
+    {
+      s->errors ++;
+      STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: lost the replies, sending %lu blocks again", inflight );
+      stm32h_resync( s, 0 );
+      // All the checks first, a resent block has its reply on the way
+      for( i = 0; i < STM32_WRITE_WINDOW_MAX; i ++ )
+        if( slots[ i ].busy &&
+            stm32h_check_block( s, slots[ i ].address, slots[ i ].pkt + STM32_WINDOW_HDRSIZE, slots[ i ].len ) == 1 )
+        {
+          stm32h_window_block_done( s, slots, &slots[ i ], address, &wrote, progress_func );
+          inflight --;
+        }
+      for( i = 0; i < STM32_WRITE_WINDOW_MAX; i ++ )
+        if( slots[ i ].busy && stm32h_resend_window_block( s, &slots[ i ] ) != STM32_OK )
+          return STM32_COMM_ERROR;
+      continue;
+    }
+    if( reply[ 0 ] == STM32_COMM_ACK )
+    {
+      stm32h_window_block_done( s, slots, slot, address, &wrote, progress_func );
+      inflight --;
+    }
+    else
+    {
+      s->errors ++;
+      if( stm32h_resend_window_block( s, slot ) != STM32_OK )
+        return STM32_COMM_ERROR;
+    }
+
+    // Auto window: as many blocks as the link sends during one round trip
+    if( !tuned )
+    {
+      gettimeofday( &now, NULL );
+      rtt = ( now.tv_sec - start.tv_sec ) + ( now.tv_usec - start.tv_usec ) / 1000000.0;
+      secs = ( STM32_WINDOW_HDRSIZE + 3 + blocksize ) * stm32h_byte_time( s );
+      window = secs > 0 ? ( u32 )( rtt / secs ) + 1 : STM32_WRITE_WINDOW_MAX;
+      if( window > STM32_WRITE_WINDOW_MAX )
+        window = STM32_WRITE_WINDOW_MAX;
+      tuned = 1;
+      STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: round trip %.2f ms, %.2f ms to send a block, window of %lu blocks",
+          rtt * 1000, secs * 1000, window );
+    }
+  }
+
+  if (s->devselection == CAN)
+    stm32h_CANreport( s, "wrote", wrote - s->resumeoffset, &start, txframes, rxframes, txbytes, rxbytes );
+  else if (s->devselection == USART)
+    stm32h_SERreport( s, "wrote", wrote - s->resumeoffset, blocks, &start, rdcalls, wrcalls );
+  gettimeofday( &now, NULL );
+  secs = ( now.tv_sec - start.tv_sec ) + ( now.tv_usec - start.tv_usec ) / 1000000.0;
+  STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: %lu blocks with up to %lu in flight, %.2f ms per KB",
+      blocks, window, wrote > s->resumeoffset ? secs * 1000.0 * 1024 / ( wrote - s->resumeoffset ) : 0 );
+  stm32h_retry_report( s, errors, retries );
+  return STM32_OK;
+}
+
 // Program flash
 // Requires pointers to two functions: get data and progress report
-int stm32_write_flash( p_read_data read_data_func, p_progress progress_func )
+// In CAN multicast mode all the nodes are programmed at the same time
+int stm32_write_flash( stm32_session *s, p_read_data read_data_func, p_progress progress_func )
 {
   u32 wrote = 0;
-  u8 data[ STM32_WRITE_BUFSIZE + 1 ];
+  u8 data[ STM32_WRITE_HDRSIZE + STM32_WRITE_EXT_MAXSIZE ];
   u32 datalen, address = STM32_FLASH_START_ADDRESS;
-  int cbbltest;
-  printf("\nhost: starting to write memory");
-
-  address = custombaseaddress;
-  printf("host: programming Flash starting from: %x", address, address);
+  u32 blocksize = stm32_write_blocksize( s );
+  u32 alive = ( 1 << s->can_nnodes ) - 1;
+  int i;
+  struct timeval start;
+  u32 txframes = s->can_txframes, rxframes = s->can_rxframes;
+  u32 txbytes = s->can_txbytes, rxbytes = s->can_rxbytes;
+  u32 rdcalls = 0, wrcalls = 0, blocks = 0;
+  u32 skipped = 0, skippedblocks = 0;
+  u32 errors = s->errors, retries = s->retries;
+  struct timeval now;
+  double secs;
+  u32 first = 0, count = 0, nexterase = 0, page;
+  int pipelined = 0;
+
+  if (s->devselection == USART)
+    ser_get_syscalls( s->ser_id, &rdcalls, &wrcalls );
+  // Windowed single node write when asked for and listed
+  if( s->window && s->can_nnodes == 0 && stm32_has_cap( s, STM32_CMD_WRITE_WINDOW ) )
+    return stm32h_write_flash_window( s, read_data_func, progress_func );
+
+  gettimeofday( &start, NULL );
+  STM32_LOG( STM32_LOG_PROGRESS, "\nhost: starting to write memory");
+
+  address = s->baseaddress + s->resumeoffset;
+  wrote = s->resumeoffset;
+  STM32_LOG( STM32_LOG_PROGRESS, "host: programming Flash starting from: %lx", address);
+  STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: %lu byte write blocks", blocksize );
 
   /*
   printf("\n");
@@ -453,84 +1391,439 @@ int stm32_write_flash( p_read_data read_data_func, p_progress progress_func )
 
   */
 
+  // Pipelined programming: every page is erased in the background one page
+  // ahead of the writes, instead of one erase of the whole image up front
+  if( s->pipeline && stm32_has_cap( s, STM32_CMD_ERASE_ASYNC ) && s->imagesize > s->resumeoffset && s->can_nnodes == 0 &&
+      stm32_flash_pages( address, s->imagesize - s->resumeoffset, &first, &count ) == STM32_OK )
+  {
+    pipelined = 1;
+    nexterase = first;
+    STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: pipelined erase of %lu pages while writing", count );
+  }
+
   //STM32_CHECK_INIT;
   while( 1 )
   {
 	//delay(9);
     // Read data to program
-    if( ( datalen = read_data_func( data + 1, STM32_WRITE_BUFSIZE ) ) == 0 ) {
-    printf("\n\thost: bin code packet length is %d", datalen);
+    if( ( datalen = read_data_func( s->user, data + STM32_WRITE_HDRSIZE, blocksize ) ) == 0 ) {
+    STM32_LOG( STM32_LOG_TRACE, "\n\thost: bin code packet length is %lu", datalen);
       break;
     }
-    printf("\n\thost: bin code packet length is %d", datalen);
-    data[ 0 ] = ( u8 )( datalen - 1 );
-
-    // Send write request
-    //delay(9);
-    printf("\n\thost: sending write request command, 0x31");
-    stm32h_send_command( STM32_CMD_WRITE_FLASH );
-    STM32_EXPECT( STM32_COMM_ACK );
-    printf("\n\thost: ack received (write request ack)");
-    
-    // Send address
-    //delay(9);
-    printf("\n\thost: sending address: %x", address);
-    stm32h_send_address( address );
-    STM32_EXPECT( STM32_COMM_ACK );
-    printf("\n\thost: ack received (address ok)");
-
-    // Send data
-    //delay(9);
-    printf("\n\thost: sending data...");
-    stm32h_send_packet_with_checksum( data, datalen + 1 );
-    printf("\n\thost: data sent... now waiting for ack");
-    //delay(9);
-    cbbltest = stm32h_read_byte();
-    if (cbbltest == -1) printf("\n\tread byte failed, %x, %d", cbbltest, cbbltest);
-    if(cbbltest != STM32_COMM_ACK) {
-    	printf("\n\thost: ack not received, instead I received %x",cbbltest);
-    	return STM32_COMM_ERROR;
+    STM32_LOG( STM32_LOG_TRACE, "\n\thost: bin code packet length is %lu", datalen);
+
+    // Pages under this block and the next one must be (being) erased
+    if( pipelined )
+    {
+      page = ( address + datalen - 1 - STM32_FLASH_BASE ) / STM32_FLASH_PAGES_SIZE + 1;
+      for( ; nexterase <= page && nexterase < first + count; nexterase ++ )
+        if( stm32h_erase_page_async( s, nexterase ) != STM32_OK )
+          return STM32_COMM_ERROR;
+    }
+
+    // Erased flash already reads 0xFF, padding blocks need not be sent
+    if( s->sparse && stm32h_block_erased( data + STM32_WRITE_HDRSIZE, datalen ) )
+    {
+      skipped += datalen;
+      skippedblocks ++;
+    }
+    else if( s->can_nnodes > 0 )
+    {
+      if( ( alive = stm32h_CANwrite_block_mcast( s, alive, address, data, datalen ) ) == 0 )
+        return STM32_COMM_ERROR;
+      blocks ++;
     }
-    printf("\n\thost: ack received (data packet ok)");
+    else if( stm32h_write_block_retry( s, address, data, datalen ) != STM32_OK )
+      return STM32_COMM_ERROR;
+    else
+      blocks ++;
 
     // Call progress function (if provided)
     wrote += datalen;
     if( progress_func )
-      progress_func( wrote );
+      progress_func( s->user, wrote );
+    stm32h_journal( s, wrote );
 
     // Advance to next data
     address += datalen;
   }
-  printf("\n\thost: returning, write successful\n");
+  if (s->devselection == CAN)
+    stm32h_CANreport( s, "wrote", wrote - s->resumeoffset, &start, txframes, rxframes, txbytes, rxbytes );
+  else if (s->devselection == USART)
+    stm32h_SERreport( s, "wrote", wrote - s->resumeoffset, blocks, &start, rdcalls, wrcalls );
+  gettimeofday( &now, NULL );
+  secs = ( now.tv_sec - start.tv_sec ) + ( now.tv_usec - start.tv_usec ) / 1000000.0;
+  STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: %lu write round trips of up to %lu bytes, %.2f ms per KB",
+      blocks, blocksize, wrote > s->resumeoffset ? secs * 1000.0 * 1024 / ( wrote - s->resumeoffset ) : 0 );
+  stm32h_retry_report( s, errors, retries );
+  if( s->sparse )
+  {
+    // Time saved estimated from the average time of the blocks actually sent
+    STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: sparse write skipped %lu erased bytes (%lu blocks), about %.3f s saved",
+        skipped, skippedblocks, wrote - s->resumeoffset > skipped ? secs * skipped / ( wrote - s->resumeoffset - skipped ) : 0 );
+  }
+  for( i = 0; i < s->can_nnodes; i ++ )
+    STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: node %d: %s", s->can_nodes[ i ], ( alive & ( 1 << i ) ) ? "written" : "FAILED" );
+  if( alive != ( u32 )( 1 << s->can_nnodes ) - 1 )
+    return STM32_COMM_ERROR;
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: returning, write successful\n");
   return STM32_OK;
 }
 
 // Jump to application
-int stm32_jump() {
+int stm32_jump( stm32_session *s ) {
 	u32 address;
 	/*
 	printf("\n");
 	printf("host: Type address to jump to (default 0x08006000):\n");
 	scanf("%x", &address);
 	*/
-	address = custombaseaddress;
-	printf("host: jumping to: %x", address, address);
-	stm32h_send_command( STM32_CMD_GO );
+	address = s->baseaddress;
+	STM32_LOG( STM32_LOG_PROGRESS, "host: jumping to: %lx", address);
+	stm32h_send_command( s, STM32_CMD_GO );
+	STM32_EXPECT( STM32_COMM_ACK );
+	STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (jump request)");
+	stm32h_send_address( s, address );
+	STM32_EXPECT( STM32_COMM_ACK );
+	STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (address ok)\n");
+	return STM32_OK;
+}
+
+// Helper: read one block of len bytes (1 to 256) at the given address
+static int stm32h_read_block( stm32_session *s, u32 address, u8 *data, u32 len )
+{
+	u8 length = ( u8 )( len - 1 );
+	u8 bt;
+
+	//send command
+	STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: sending read request command, 0x11");
+	stm32h_send_command( s, STM32_CMD_READ_FLASH );
+	STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: command sent, waiting for ack..");
+	bt = stm32h_read_byte( s );
+	STM32_LOG( STM32_LOG_TRACE, "\n\thost: bt = %x", bt);
+	if(bt != STM32_COMM_ACK ) return STM32_COMM_ERROR;
+	//STM32_EXPECT( STM32_COMM_ACK );
+	STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (read request ack)");
+
+	//send address
+	STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: sending address: %lx", address);
+	stm32h_send_address( s, address );
 	STM32_EXPECT( STM32_COMM_ACK );
-	printf("\n\thost: ack received (jump request)");
-	stm32h_send_address( address );
+	STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (address ok)");
+
+	//sending data length
+	STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: sending data length to read...");
+	stm32h_send_packet_with_checksum( s, &length, 1);
 	STM32_EXPECT( STM32_COMM_ACK );
-	printf("\n\thost: ack received (address ok)\n");
+	STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: ack received (data length ok)...");
+
+	//receiving bytes
+	STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: receiving data from flash...");
+	if (stm32h_read_bytes( s, data, len) != len) return STM32_COMM_ERROR;
+	return STM32_OK;
+}
+
+// Helper: read one block, again (up to STM32_RETRY_COUNT times in all)
+// until it comes in whole
+static int stm32h_read_block_retry( stm32_session *s, u32 address, u8 *data, u32 len )
+{
+	int tries;
+
+	for (tries = 0; tries < STM32_RETRY_COUNT; tries++) {
+		if (tries > 0) {
+			s->retries++;
+			STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: reading block at %lx again (try %d)", address, tries + 1 );
+			stm32h_resync( s, tries - 1 );
+		}
+		if (stm32h_read_block( s, address, data, len ) == STM32_OK) return STM32_OK;
+		s->errors++;
+	}
+	fprintf( stderr, "\nhost: read failed at %lx after %d tries\n", address, tries );
+	return STM32_COMM_ERROR;
+}
+
+// Read size bytes of memory from the given address
+int stm32_read_memory( stm32_session *s, u32 address, u8 *dst, u32 size )
+{
+	u32 len;
+
+	while (size > 0) {
+		len = size > STM32_WRITE_BUFSIZE ? STM32_WRITE_BUFSIZE : size;
+		if (stm32h_read_block_retry( s, address, dst, len ) != STM32_OK) return STM32_COMM_ERROR;
+		address += len;
+		dst += len;
+		size -= len;
+	}
 	return STM32_OK;
 }
 
+// Check the write protection option bytes, WRP0 to WRP3 are 0xFF when no
+// page is protected. Returns 0 if nothing is protected, 1 if some pages are
+// or the option bytes cannot be read
+int stm32_write_protected( stm32_session *s )
+{
+  u8 ob[ 16 ];
+  int i;
+
+  if( stm32h_read_block( s, STM32_OPTION_BYTES, ob, sizeof( ob ) ) != STM32_OK )
+  {
+    stm32h_resync( s, 0 );
+    return 1;
+  }
+  for( i = 8; i < 16; i += 2 )
+    if( ob[ i ] != 0xFF )
+      return 1;
+  return 0;
+}
+
+// CRC-32 (IEEE 802.3, same as zlib), start with crc = 0
+u32 stm32_crc32( u32 crc, const u8 *data, u32 size )
+{
+  u32 i;
+  int j;
+
+  crc ^= 0xFFFFFFFF;
+  for( i = 0; i < size; i ++ )
+  {
+    crc ^= data[ i ];
+    for( j = 0; j < 8; j ++ )
+      crc = ( crc >> 1 ) ^ ( 0xEDB88320 & -( crc & 1 ) );
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+// Compare the CRC-32 of size bytes of memory at address, computed by the
+// bootloader (CBBL extension), with the one of data
+// Expected response: ACK (command) ACK (address) ACK (length) CRC[4] ACK
+int stm32_verify_crc( stm32_session *s, u32 address, const u8 *data, u32 size )
+{
+  u8 buf[ 4 ];
+  u32 crc, expected;
+
+  stm32h_send_command( s, STM32_CMD_CRC );
+  STM32_EXPECT( STM32_COMM_ACK );
+  stm32h_send_address( s, address );
+  STM32_EXPECT( STM32_COMM_ACK );
+  buf[ 0 ] = size >> 24;
+  buf[ 1 ] = ( size >> 16 ) & 0xFF;
+  buf[ 2 ] = ( size >> 8 ) & 0xFF;
+  buf[ 3 ] = size & 0xFF;
+  stm32h_send_packet_with_checksum( s, buf, 4 );
+  STM32_EXPECT( STM32_COMM_ACK );
+  if( stm32h_read_bytes( s, buf, 4 ) != 4 )
+    return STM32_COMM_ERROR;
+  STM32_EXPECT( STM32_COMM_ACK );
+  crc = ( ( u32 )buf[ 0 ] << 24 ) | ( ( u32 )buf[ 1 ] << 16 ) | ( ( u32 )buf[ 2 ] << 8 ) | buf[ 3 ];
+  expected = stm32_crc32( 0, data, size );
+  STM32_LOG( STM32_LOG_PROTOCOL, "\n\thost: CRC %08lX, expected %08lX", crc, expected );
+  return crc == expected ? STM32_OK : STM32_COMM_ERROR;
+}
+
+// Helper: find which of two rates the bootloader is at, the one where it
+// gets back in step. Leaves s->baud at the rate found, returns 0 if neither
+// answers
+static u32 stm32h_probe_baud( stm32_session *s, u32 first, u32 second )
+{
+  u32 rates[ 2 ] = { first, second };
+  int tries, i;
+
+  for( tries = 0; tries < STM32_RETRY_COUNT; tries ++ )
+    for( i = 0; i < 2; i ++ )
+    {
+      if( ser_set_baud( s->ser_id, rates[ i ] ) != SER_OK )
+        continue;
+      s->baud = rates[ i ];
+      if( stm32h_resync( s, 0 ) )
+        return rates[ i ];
+    }
+  return 0;
+}
+
+// Switch the USART rate (CBBL extension). The bootloader ACKs the rate at
+// the old rate and switches, then goes back to the old rate unless an init
+// byte comes in at the new one within STM32_BAUD_CONFIRM_TIMEOUT.
+// Expected response: ACK (command) ACK (rate) ACK (init byte, new rate)
+// On failure s->baud is the rate the bootloader was found at.
+int stm32_set_baud( stm32_session *s, u32 baud )
+{
+  u8 buf[ 4 ];
+  u32 old = s->baud;
+  int res;
+
+  if( s->devselection != USART || !stm32_has_cap( s, STM32_CMD_SET_BAUD ) )
+    return STM32_COMM_ERROR;
+  stm32h_send_command( s, STM32_CMD_SET_BAUD );
+  STM32_EXPECT( STM32_COMM_ACK );
+  buf[ 0 ] = baud >> 24;
+  buf[ 1 ] = ( baud >> 16 ) & 0xFF;
+  buf[ 2 ] = ( baud >> 8 ) & 0xFF;
+  buf[ 3 ] = baud & 0xFF;
+  stm32h_send_packet_with_checksum( s, buf, 4 );
+  if( ( res = stm32h_read_byte( s ) ) == STM32_COMM_NACK )
+    return STM32_COMM_ERROR; // rate not supported by the device
+  if( res == STM32_COMM_ACK && ser_set_baud( s->ser_id, baud ) == SER_OK )
+  {
+    s->baud = baud;
+    ser_write_byte( s->ser_id, STM32_CMD_INIT );
+    if( stm32h_read_byte_timeout( s, STM32_BAUD_CONFIRM_TIMEOUT / 2 ) == STM32_COMM_ACK )
+      return STM32_OK;
+  }
+
+  // Rate ACK or init byte ACK lost: wait for the bootloader to go back to
+  // the old rate, unless it took the init byte
+  s->errors ++;
+  usleep( STM32_BAUD_CONFIRM_TIMEOUT );
+  stm32h_probe_baud( s, old, baud );
+  return STM32_COMM_ERROR;
+}
+
+// Helper: test burst at the current rate, STM32_BAUD_TEST_SIZE bytes read
+// without retries and checked against the bootloader CRC (or against a
+// second read without it). The packets the host sends carry checksums.
+static int stm32h_baud_test( stm32_session *s )
+{
+  u8 data[ STM32_BAUD_TEST_SIZE ], again[ STM32_WRITE_BUFSIZE ];
+  int crc = stm32_has_cap( s, STM32_CMD_CRC );
+  u32 i;
+
+  for( i = 0; i < STM32_BAUD_TEST_SIZE; i += STM32_WRITE_BUFSIZE )
+  {
+    if( stm32h_read_block( s, s->baseaddress + i, data + i, STM32_WRITE_BUFSIZE ) != STM32_OK )
+      return STM32_COMM_ERROR;
+    if( !crc && ( stm32h_read_block( s, s->baseaddress + i, again, STM32_WRITE_BUFSIZE ) != STM32_OK ||
+        memcmp( data + i, again, STM32_WRITE_BUFSIZE ) ) )
+      return STM32_COMM_ERROR;
+  }
+  return crc ? stm32_verify_crc( s, s->baseaddress, data, STM32_BAUD_TEST_SIZE ) : STM32_OK;
+}
+
+// Switch to the given rate and keep it if a test burst goes through without
+// errors, go back to the current rate otherwise.
+// Returns STM32_OK at the new rate, STM32_COMM_ERROR back at the old one,
+// STM32_INIT_ERROR if the bootloader is lost
+int stm32_try_baud( stm32_session *s, u32 baud )
+{
+  u32 old = s->baud;
+  int tries;
+
+  if( stm32_set_baud( s, baud ) == STM32_OK )
+  {
+    if( stm32h_baud_test( s ) == STM32_OK )
+    {
+      STM32_LOG( STM32_LOG_PROGRESS, "host: %lu baud test passed\n", baud );
+      return STM32_OK;
+    }
+    s->errors ++;
+  }
+  STM32_LOG( STM32_LOG_PROGRESS, "host: %lu baud failed, back to %lu baud\n", baud, old );
+  for( tries = 0; s->baud != old && tries < STM32_RETRY_COUNT; tries ++ )
+  {
+    stm32h_resync( s, tries );
+    stm32_set_baud( s, old );
+  }
+  return s->baud == old ? STM32_COMM_ERROR : STM32_INIT_ERROR;
+}
+
+// Go up the standard rates above the current one, up to maxbaud, and keep
+// the fastest one that passes its test burst
+// Returns STM32_OK unless the bootloader is lost
+int stm32_ramp_baud( stm32_session *s, u32 maxbaud )
+{
+  static const u32 steps[] = { 230400, 460800, 921600, 1000000, 1500000, 2000000, 3000000, 4000000 };
+  int i, res;
+
+  if( s->devselection != USART || !stm32_has_cap( s, STM32_CMD_SET_BAUD ) )
+    return STM32_OK;
+  for( i = 0; i < ( int )( sizeof( steps ) / sizeof( steps[ 0 ] ) ) && steps[ i ] <= maxbaud; i ++ )
+  {
+    if( steps[ i ] <= s->baud )
+      continue;
+    if( ( res = stm32_try_baud( s, steps[ i ] ) ) != STM32_OK )
+      return res == STM32_INIT_ERROR ? res : STM32_OK;
+  }
+  return STM32_OK;
+}
+
+// Low latency mode for USB-serial adapters: ASYNC_LOW_LATENCY on the port
+// and the adapter latency timer (FTDI, 16 ms by default) down to
+// STM32_LATENCY_TIMER, as far as the driver and the permissions allow.
+// Both are put back by stm32_close. Returns STM32_COMM_ERROR if neither applies.
+int stm32_low_latency( stm32_session *s )
+{
+  int timer;
+
+  if( s->devselection != USART )
+    return STM32_COMM_ERROR;
+  if( ( s->prev_low_latency = ser_set_low_latency( ( int )s->ser_id, 1 ) ) == -1 )
+    STM32_LOG( STM32_LOG_PROGRESS, "host: %s does not take ASYNC_LOW_LATENCY\n", s->portname );
+  if( ( timer = ser_get_latency_timer( s->portname ) ) == -1 )
+    STM32_LOG( STM32_LOG_PROGRESS, "host: %s has no latency timer\n", s->portname );
+  else if( timer > STM32_LATENCY_TIMER && ser_set_latency_timer( s->portname, STM32_LATENCY_TIMER ) != SER_OK )
+    STM32_LOG( STM32_LOG_PROGRESS, "host: %s latency timer %d ms, not permitted to change it\n", s->portname, timer );
+  else if( timer > STM32_LATENCY_TIMER )
+  {
+    s->prev_latency_timer = timer;
+    STM32_LOG( STM32_LOG_PROGRESS, "host: %s latency timer %d ms -> %d ms\n", s->portname, timer, STM32_LATENCY_TIMER );
+  }
+  return s->prev_low_latency == -1 && s->prev_latency_timer == -1 ? STM32_COMM_ERROR : STM32_OK;
+}
+
+// Helper: order round trip times
+static int stm32h_cmp_u32( const void *a, const void *b )
+{
+  u32 x = *( const u32* )a, y = *( const u32* )b;
+
+  return x < y ? -1 : x > y;
+}
+
+// Measure STM32_RTT_PROBES command round trips and report the percentiles.
+// The probe is a command with a wrong complement (0xFF 0xFF), NACKed at once.
+// median gets the 50th percentile in us.
+int stm32_profile_rtt( stm32_session *s, const char *what, u32 *median )
+{
+  static const u8 probe[ 2 ] = { 0xFF, 0xFF };
+  u32 rtt[ STM32_RTT_PROBES ], n = 0, i;
+  struct timeval start, now;
+
+  for( i = 0; i < STM32_RTT_PROBES; i ++ )
+  {
+    gettimeofday( &start, NULL );
+    if (s->devselection == USART) ser_write( s->ser_id, probe, 2 );
+    else if (s->devselection == CAN) stm32h_CANwrite_bytes( s, probe, 2 );
+    if( stm32h_read_byte( s ) != STM32_COMM_NACK )
+    {
+      stm32h_resync( s, 0 );
+      continue;
+    }
+    gettimeofday( &now, NULL );
+    rtt[ n ++ ] = ( now.tv_sec - start.tv_sec ) * 1000000 + now.tv_usec - start.tv_usec;
+  }
+  if( n == 0 )
+    return STM32_COMM_ERROR;
+  qsort( rtt, n, sizeof( rtt[ 0 ] ), stm32h_cmp_u32 );
+  *median = rtt[ n / 2 ];
+  STM32_LOG( STM32_LOG_PROGRESS, "host: %s round trip p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms (%lu probes)\n",
+      what, rtt[ n / 2 ] / 1000.0, rtt[ n * 9 / 10 ] / 1000.0, rtt[ n * 99 / 100 ] / 1000.0, rtt[ n - 1 ] / 1000.0, n );
+  return STM32_OK;
+}
+
 // Read flash memory
-int stm32_read_flash(FILE* fflash) {
+int stm32_read_flash( stm32_session *s, FILE* fflash) {
 
 	u32 address;
 	u8 length = 255;
 	u8 data[length+1];
-	int numwritten, i;
+	int numwritten;
+	u32 nread = 0;
+	struct timeval start;
+	u32 txframes = s->can_txframes, rxframes = s->can_rxframes;
+	u32 txbytes = s->can_txbytes, rxbytes = s->can_rxbytes;
+	u32 rdcalls = 0, wrcalls = 0, blocks = 0;
+	u32 errors = s->errors, retries = s->retries;
+
+	if (s->devselection == USART)
+		ser_get_syscalls( s->ser_id, &rdcalls, &wrcalls );
+	gettimeofday( &start, NULL );
 
 	//ask base address to user
 	/*
@@ -540,47 +1833,144 @@ int stm32_read_flash(FILE* fflash) {
 	scanf("%x", &address);
 	*/
 
-	address = custombaseaddress;
-	printf("host: reading Flash starting from %x until %x", address, STM32_FLASH_END_ADDRESS);
+	address = s->baseaddress;
+	STM32_LOG( STM32_LOG_PROGRESS, "host: reading Flash starting from %lx until %x", address, STM32_FLASH_END_ADDRESS);
 
 	//one instance of the command allows to fetch 256 bytes maximum due to protocol specification
 	//length=255 to fit it into u8, representing 256 bytes (0-255)
 	for(; address<STM32_FLASH_END_ADDRESS; address=address+length+1) {
 
-		//send command
-		u8 bt;
-		printf("\n\thost: sending read request command, 0x11");
-		stm32h_send_command( STM32_CMD_READ_FLASH );
-		printf("\n\thost: command sent, waiting for ack..");
-		bt = stm32h_read_byte();
-		printf("\n\thost: bt = %x", bt);
-		if(bt != STM32_COMM_ACK ) return STM32_COMM_ERROR;
-		//STM32_EXPECT( STM32_COMM_ACK );
-		printf("\n\thost: ack received (read request ack)");
-
-		//send address
-		printf("\n\thost: sending address: %x", address);
-		stm32h_send_address( address );
-		STM32_EXPECT( STM32_COMM_ACK );
-		printf("\n\thost: ack received (address ok)");
-
-		//sending data length
-		printf("\n\thost: sending data length to read...");
-		if (STM32_OK == stm32h_send_packet_with_checksum(&length, 1));
-		STM32_EXPECT( STM32_COMM_ACK );
-		printf("\n\thost: ack received (data length ok)...");
-
-		//receiving bytes
-		printf("\n\thost: receiving data from flash...");
-		for (i=0; i<length+1; i++) {
-			data[i]=(u8)stm32h_read_byte();
-			//("\n\thost: data[%d]=%x", i, data[i]);
-		}
+		if (stm32h_read_block_retry( s, address, data, length+1 ) != STM32_OK) return STM32_COMM_ERROR;
 		numwritten = fwrite( data, sizeof(u8), length+1, fflash);
-		printf("\n\t\thost: bytes written to file %d", numwritten);
+		STM32_LOG( STM32_LOG_TRACE, "\n\t\thost: bytes written to file %d", numwritten);
+		nread += length+1;
+		blocks++;
 
 		//delay(99);
 
 	}
+	if (s->devselection == CAN)
+		stm32h_CANreport( s, "read", nread, &start, txframes, rxframes, txbytes, rxbytes );
+	else if (s->devselection == USART)
+		stm32h_SERreport( s, "read", nread, blocks, &start, rdcalls, wrcalls );
+	stm32h_retry_report( s, errors, retries );
+	return STM32_OK;
+}
+
+// Helper: erase the given pages in one page list and write back the part
+// of the image they hold
+static int stm32h_rewrite_pages( stm32_session *s, const u8 *image, u32 size, const u8 *pages, u32 npages, p_progress progress_func )
+{
+	u8 data[ STM32_WRITE_HDRSIZE + STM32_WRITE_EXT_MAXSIZE ];
+	u32 blocksize = stm32_write_blocksize( s );
+	u32 from, to, len, address, i;
+
+	if (npages == 0) return STM32_OK;
+	// Nothing restores the bytes below an unaligned base address
+	if (( s->baseaddress - STM32_FLASH_BASE ) % STM32_FLASH_PAGES_SIZE) return STM32_COMM_ERROR;
+	if (stm32_erase_page_list( s, pages, npages ) != STM32_OK) return STM32_COMM_ERROR;
+	for (i = 0; i < npages; i++) {
+		address = STM32_FLASH_BASE + pages[ i ] * STM32_FLASH_PAGES_SIZE;
+		from = address < s->baseaddress ? 0 : address - s->baseaddress;
+		to = address + STM32_FLASH_PAGES_SIZE - s->baseaddress;
+		if (to > size) to = size;
+		for (; from < to; from += len) {
+			len = to - from > blocksize ? blocksize : to - from;
+			memcpy( data + STM32_WRITE_HDRSIZE, image + from, len );
+			if (s->sparse && stm32h_block_erased( data + STM32_WRITE_HDRSIZE, len )) continue;
+			if (stm32h_write_block_retry( s, s->baseaddress + from, data, len ) != STM32_OK) return STM32_COMM_ERROR;
+		}
+		if (progress_func)
+			progress_func( s->user, ( ( i + 1 ) * size ) / npages );
+	}
 	return STM32_OK;
 }
+
+// Differential write: only the pages whose contents differ from old
+// (the last image flashed, from a cache) or, without old, from the device
+// contents (read back) are erased and written
+int stm32_write_diff( stm32_session *s, const u8 *image, u32 size, const u8 *old, u32 oldsize, p_progress progress_func )
+{
+	u8 pages[ STM32_FLASH_PAGES_NUM ];
+	u8 device[ STM32_FLASH_PAGES_SIZE ];
+	u32 first, count, page, from, to, address;
+	u32 nchanged = 0;
+	u32 errors = s->errors, retries = s->retries;
+	struct timeval start, now;
+
+	if (stm32_flash_pages( s->baseaddress, size, &first, &count ) != STM32_OK) return STM32_COMM_ERROR;
+	gettimeofday( &start, NULL );
+
+	// Find the pages that changed, comparing only the part the image covers
+	for (page = first; page < first + count; page++) {
+		address = STM32_FLASH_BASE + page * STM32_FLASH_PAGES_SIZE;
+		from = address < s->baseaddress ? 0 : address - s->baseaddress;
+		to = address + STM32_FLASH_PAGES_SIZE - s->baseaddress;
+		if (to > size) to = size;
+		if (old) {
+			if (to > oldsize || memcmp( image + from, old + from, to - from ) != 0)
+				pages[ nchanged++ ] = ( u8 )page;
+		}
+		else {
+			if (stm32_read_memory( s, s->baseaddress + from, device, to - from ) != STM32_OK) return STM32_COMM_ERROR;
+			if (memcmp( image + from, device, to - from ) != 0)
+				pages[ nchanged++ ] = ( u8 )page;
+		}
+	}
+	STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: %lu pages changed, %lu unchanged (compared with %s)",
+			nchanged, count - nchanged, old ? "the cache" : "the device" );
+
+	if (stm32h_rewrite_pages( s, image, size, pages, nchanged, progress_func ) != STM32_OK) return STM32_COMM_ERROR;
+
+	gettimeofday( &now, NULL );
+	STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: differential write of %lu pages in %.3f s",
+			nchanged, ( now.tv_sec - start.tv_sec ) + ( now.tv_usec - start.tv_usec ) / 1000000.0 );
+	stm32h_retry_report( s, errors, retries );
+	return STM32_OK;
+}
+
+// Verify: read back exactly the image range and compare it with the image
+// block by block as it arrives, computing its CRC-32 on the way. Without
+// repair it stops at the first mismatch (STM32_VERIFY_ERROR), with repair
+// the pages holding mismatched blocks are rewritten and checked again.
+int stm32_verify_flash( stm32_session *s, const u8 *image, u32 size, int repair, u32 *crc, p_progress progress_func )
+{
+	u8 data[ STM32_WRITE_BUFSIZE ];
+	u8 pages[ STM32_FLASH_PAGES_NUM ];
+	u32 offset, len, i, page, last, npages = 0, nbad = 0;
+	u32 errors = s->errors, retries = s->retries;
+	struct timeval start, now;
+
+	gettimeofday( &start, NULL );
+	*crc = 0;
+	for (offset = 0; offset < size; offset += len) {
+		len = size - offset > STM32_WRITE_BUFSIZE ? STM32_WRITE_BUFSIZE : size - offset;
+		if (stm32h_read_block_retry( s, s->baseaddress + offset, data, len ) != STM32_OK) return STM32_COMM_ERROR;
+		*crc = stm32_crc32( *crc, data, len );
+		if (progress_func)
+			progress_func( s->user, offset + len );
+		if (memcmp( data, image + offset, len ) == 0) continue;
+
+		nbad++;
+		for (i = 0; data[ i ] == image[ offset + i ]; i++);
+		STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: mismatch at %lx: %02X instead of %02X",
+				s->baseaddress + offset + i, data[ i ], image[ offset + i ] );
+		if (!repair) return STM32_VERIFY_ERROR;
+
+		// Pages under the block, each one once
+		page = ( s->baseaddress + offset - STM32_FLASH_BASE ) / STM32_FLASH_PAGES_SIZE;
+		last = ( s->baseaddress + offset + len - 1 - STM32_FLASH_BASE ) / STM32_FLASH_PAGES_SIZE;
+		for (; page <= last; page++)
+			if (npages == 0 || pages[ npages - 1 ] != page)
+				pages[ npages++ ] = ( u8 )page;
+	}
+	gettimeofday( &now, NULL );
+	STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: verified %lu bytes in %.3f s, CRC-32 %08lX, %lu blocks differ",
+			size, ( now.tv_sec - start.tv_sec ) + ( now.tv_usec - start.tv_usec ) / 1000000.0, *crc, nbad );
+	stm32h_retry_report( s, errors, retries );
+	if (npages == 0) return STM32_OK;
+
+	STM32_LOG( STM32_LOG_PROGRESS, "\n\thost: rewriting %lu pages", npages );
+	if (stm32h_rewrite_pages( s, image, size, pages, npages, NULL ) != STM32_OK) return STM32_COMM_ERROR;
+	return stm32_verify_flash( s, image, size, 0, crc, progress_func );
+}
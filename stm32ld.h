@@ -4,16 +4,15 @@
 #define __STM32LD_H__
 
 #include "type.h"
+#include "canif.h"
+#include "log.h"
+#include <stdio.h>
 #include <fcntl.h>
-#include <libpcan.h>
 
-// Global variable for the device to be used
+// Device to be used
 #define CAN 2
 #define USART 1
 
-// Global variable to be assigned a value either CAN or USART
-int devselection;
-
 // Error codes
 enum
 {
@@ -22,56 +21,196 @@ enum
   STM32_COMM_ERROR,
   STM32_INIT_ERROR,
   STM32_TIMEOUT_ERROR,
-  STM32_NOT_INITIALIZED_ERROR
+  STM32_NOT_INITIALIZED_ERROR,
+  STM32_VERIFY_ERROR
 };
 
 // Communication data
 #define STM32_COMM_ACK      0x79
 #define STM32_COMM_NACK     0x1F
 #define STM32_COMM_TIMEOUT  2000000
+#define STM32_SYNC_TIMEOUT  100000 // us for the answer to each init byte, longer than any round trip
+#define STM32_ACK_TIMEOUT   100000 // us for a write ACK on top of the transfer and programming time (adapters, a page erase in the background)
+#define STM32_PROGRAM_TIME  40000 // us to program 1 KB of FLASH, worst case (STM32F1 half-word programming)
+#define STM32_SYNC_RETRIES  20 // init bytes sent while the bootloader starts
+#define STM32_RESET_PULSE   10000 // us NRST is held low for a modem line reset
 #define STM32_WRITE_BUFSIZE 256
+#define STM32_WRITE_EXT_MAXSIZE ( 2 * STM32_FLASH_PAGES_SIZE ) // largest extended write block
+#define STM32_WRITE_HDRSIZE 2 // room left before the data of a write block for its length
+#define STM32_WINDOW_HDRSIZE 7 // windowed write header: sequence number, address, length - 1
+#define STM32_WRITE_WINDOW_MAX 8 // windowed write transactions the bootloader buffers
+#define STM32_WRITE_WINDOW_AUTO ( ( u32 )-1 ) // window sized from the measured round trip time
+#define STM32_CAN_MAX_DLEN  8
+#define STM32_CAN_RXRING_SIZE 4096 // must be a power of 2
+#define STM32_CAN_TXBATCH   64 // frames handed to the CAN layer at once
+#define STM32_CAN_RXBATCH   64 // frames taken from the CAN layer at once
+#define STM32_CAN_BITRATE   1000000
+
+// CAN identifiers. Single node sessions send on ID 0 and accept any reply ID.
+// In multicast mode (CBBL node addressing) the payload is broadcast on ID 0,
+// node n is addressed on 0x100 + n and answers on 0x180 + n
+#define STM32_CAN_ID_BROADCAST      0x000
+#define STM32_CAN_ID_TO_NODE( n )   ( 0x100u + ( n ) )
+#define STM32_CAN_ID_FROM_NODE( n ) ( 0x180u + ( n ) )
+#define STM32_CAN_MAX_NODES         16
+#define STM32_CAN_ALL_NODES         ( -1 )
 
 #define SER_BAUD (115200)
+#define STM32_BAUD_MAX      4000000 // highest rate stm32_ramp_baud tries
+#define STM32_BAUD_CONFIRM_TIMEOUT 500000 // us the bootloader waits for the init byte at a new rate
+#define STM32_BAUD_TEST_SIZE 2048 // bytes read back to test a rate
+#define STM32_RTT_PROBES    32 // round trips measured by stm32_profile_rtt
+#define STM32_LATENCY_TIMER 1 // ms, USB-serial adapter latency timer in low latency mode
 
 // Device FLASH memory data
+#define STM32_FLASH_BASE 0x08000000 //page 0
 #define STM32_FLASH_START_ADDRESS 0x08006000
 #define STM32_FLASH_END_ADDRESS 0x08020000
 #define STM32_FLASH_PAGES_NUM 128 //absolute number
 #define STM32_FLASH_PAGES_SIZE 1024 //bytes
+#define STM32_FLASH_PAGE_ERASE_TIME 40000 //us, worst case (STM32F1)
+#define STM32_OPTION_BYTES 0x1FFFF800 //WRP0, nWRP0 ... WRP3, nWRP3 from byte 8
 
-// Global variable for the custom FLASH base address
-u32 custombaseaddress;
 
 enum
 {
   STM32_CMD_INIT = 0x7F,
   STM32_CMD_GET_COMMAND = 0x00,
   STM32_CMD_ERASE_FLASH = 0x43,
+  STM32_CMD_EXT_ERASE_FLASH = 0x44,
   STM32_CMD_GET_ID = 0x02,
   STM32_CMD_WRITE_FLASH = 0x31,
   STM32_CMD_WRITE_UNPROTECT = 0x73,
   STM32_CMD_READ_FLASH = 0x11,
-  STM32_CMD_GO = 0x21
+  STM32_CMD_GO = 0x21,
+  // CBBL extensions, advertised in the GET command list when available
+  STM32_CMD_CAN_FRAMING = 0xA0,
+  STM32_CMD_CAN_FD = 0xA1,
+  STM32_CMD_ERASE_ASYNC = 0xA3, // erase one page, ACKed as soon as the erase starts
+  STM32_CMD_WRITE_EXT = 0xA4, // write memory with a 16 bit length
+  STM32_CMD_WRITE_WINDOW = 0xA5, // tagged write, answered with ACK/NACK + sequence number
+  STM32_CMD_CRC = 0xA7, // CRC-32 of a memory range, computed by the device
+  STM32_CMD_SET_BAUD = 0xA8 // switch the USART rate, confirmed by an init byte at the new rate
 };
 
-// Function types for stm32_write_flash
-typedef u32 ( *p_read_data )( u8 *dst, u32 len );
-typedef void ( *p_progress )( u32 wrote );
+#define STM32_MAX_CAPS      64 // commands kept from the GET list
+
+// CAN receive ring buffer, filled a whole frame at a time
+typedef struct
+{
+  u8 data[ STM32_CAN_RXRING_SIZE ];
+  u32 head, tail; //free running, masked on access
+} stm32_can_ring;
+
+// Session: everything needed to talk to one device, so that several
+// devices can be driven at the same time (one session per thread)
+typedef struct
+{
+  // Settings
+  int devselection; //either CAN or USART
+  u32 baseaddress; //FLASH base address for write/read/jump
+  int canfdselection; //request CAN FD bulk transfers
+  int sparse; //skip all 0xFF blocks (flash must be erased)
+  int pipeline; //erase the next page while writing the current one
+  u32 imagesize; //bytes stm32_write_flash will write, 0 if unknown
+  u32 blocksize; //write block size, 0 for a flash page when the bootloader takes it
+  u32 window; //write transactions in flight, 0 to wait for each ACK, or STM32_WRITE_WINDOW_AUTO
+  u32 baud; //serial link rate
+  u32 resumeoffset; //image bytes already on the device, stm32_write_flash goes on from there
+  int reset; //reset into the bootloader with the modem lines (RTS to BOOT0, DTR to NRST)
+  void *user; //passed to the stm32_write_flash callbacks
+
+  // Peripheral handles
+  const char *portname; //as given to stm32_init
+  ser_handler ser_id; //serial port
+  canif_handler can_id; //CAN device
+
+  // USB-serial latency settings changed by stm32_low_latency, put back by stm32_close
+  int prev_low_latency; //ASYNC_LOW_LATENCY, -1 if unchanged
+  int prev_latency_timer; //ms, -1 if unchanged
+
+  // Bootloader capabilities (GET command)
+  u8 bl_version;
+  u8 caps[ STM32_MAX_CAPS ]; //supported commands
+  int ncaps;
+
+  // Write journal (-resume): one record with the key and the image bytes
+  // the device confirmed so far
+  FILE *journal; //NULL for none
+  char journal_key[ 48 ]; //image CRC and size, chip ID, base address
+
+  // Error counters, over the whole session
+  u32 errors; //failed transactions (NACK, timeout)
+  u32 retries; //blocks sent or read again
+
+  // CAN framing state. Every node negotiates on its own: entry 0 is for
+  // single node sessions, entry n+1 for node n in multicast mode (as the
+  // receive rings). can_framed and can_fd follow the selected node, for a
+  // broadcast they are on only when every node has them on.
+  u8 can_node_framed[ STM32_CAN_MAX_NODES + 1 ];
+  u8 can_node_fd[ STM32_CAN_MAX_NODES + 1 ];
+  int can_sel; //framing state entry of the selected node, 0 for a broadcast
+  int can_framed; //multi-byte frames currently enabled
+  int can_fd; //CAN FD bulk transfers currently enabled
+  u32 can_txframes, can_rxframes;
+  u32 can_txbytes, can_rxbytes;
+
+  // CAN receive rings.
+  // Ring 0 takes single node replies, ring n+1 the replies of node n in multicast mode
+  stm32_can_ring can_rx[ STM32_CAN_MAX_NODES + 1 ];
+  stm32_can_ring *can_rxsel; //ring served to the byte readers
+
+  // CAN multicast state
+  u8 can_nodes[ STM32_CAN_MAX_NODES ]; //node numbers
+  int can_nnodes; //0 for single node sessions
+  u32 can_txid; //ID of the transmitted frames
+} stm32_session;
+
+// Function types for stm32_write_flash (arg is the session user pointer)
+typedef u32 ( *p_read_data )( void *arg, u8 *dst, u32 len );
+typedef void ( *p_progress )( void *arg, u32 wrote );
 
 // Loader functions
-int stm32_init( const char* portname, u32 baud );
-int stm32_get_bl_version( u8 *major, u8 *minor ); 
-int stm32_get_chip_id( u16 *version );
-int stm32_write_unprotect();
-int stm32_erase_flash();
-int stm32_write_flash( p_read_data read_data_func, p_progress progress_func );
-int stm32_jump();
-u8 stm32h_CANread_byte();
-void stm32h_CANwrite_byte(u8 data);
-int stm32_CAN_init ();
+void stm32_session_init( stm32_session *s, int devselection, u32 baseaddress );
+int stm32_init( stm32_session *s, const char* portname, u32 baud );
+void stm32_close( stm32_session *s );
+int stm32_get_version( stm32_session *s, u8 *major, u8 *minor );
+int stm32_has_cap( stm32_session *s, u8 cmd );
+void stm32_dump_caps( stm32_session *s );
+int stm32_get_chip_id( stm32_session *s, u16 *version );
+int stm32_set_baud( stm32_session *s, u32 baud );
+int stm32_try_baud( stm32_session *s, u32 baud );
+int stm32_ramp_baud( stm32_session *s, u32 maxbaud );
+int stm32_low_latency( stm32_session *s );
+int stm32_profile_rtt( stm32_session *s, const char *what, u32 *median );
+int stm32_write_unprotect( stm32_session *s );
+int stm32_write_protected( stm32_session *s );
+int stm32_erase_flash( stm32_session *s );
+int stm32_erase_pages( stm32_session *s, u32 first, u32 count );
+int stm32_erase_page_list( stm32_session *s, const u8 *pages, u32 count );
+int stm32_flash_pages( u32 address, u32 size, u32 *first, u32 *count );
+int stm32_write_flash( stm32_session *s, p_read_data read_data_func, p_progress progress_func );
+u32 stm32_write_blocksize( stm32_session *s );
+int stm32_journal_open( stm32_session *s, const char *path, u32 imagecrc, u32 imagesize, u16 chip_id, u32 *confirmed );
+int stm32_read_flash( stm32_session *s, FILE* fflash );
+int stm32_read_memory( stm32_session *s, u32 address, u8 *dst, u32 size );
+int stm32_verify_crc( stm32_session *s, u32 address, const u8 *data, u32 size );
+u32 stm32_crc32( u32 crc, const u8 *data, u32 size );
+int stm32_write_diff( stm32_session *s, const u8 *image, u32 size, const u8 *old, u32 oldsize, p_progress progress_func );
+int stm32_verify_flash( stm32_session *s, const u8 *image, u32 size, int repair, u32 *crc, p_progress progress_func );
+int stm32_jump( stm32_session *s );
+int stm32h_CANread_byte( stm32_session *s );
+u32 stm32h_CANread_bytes( stm32_session *s, u8 *dst, u32 len, u32 timeout );
+void stm32h_CANwrite_byte( stm32_session *s, u8 data );
+void stm32h_CANwrite_bytes( stm32_session *s, const u8 *data, u32 len );
+void stm32h_CANwrite_bulk( stm32_session *s, const u8 *data, u32 len );
+int stm32_CAN_init( stm32_session *s );
+int stm32_CAN_set_nodes( stm32_session *s, const u8 *nodes, int nnodes );
+void stm32_CAN_select_node( stm32_session *s, int node );
 
 // Utils
 #define STM32_RETRY_COUNT	10
+#define STM32_RETRY_BACKOFF	10000 // us before the first retry, doubled at every retry
 
 #endif
 
@@ -0,0 +1,1334 @@
+// STM32 bootloader device model
+//
+// Answers the bootloader protocol the loader speaks (CBBL extensions
+// included) so the loader can be tried and measured without a board:
+// - USART: on the slave side of a pty, stm32ld_cbbl -usart /dev/pts/N ...
+// - CAN: on a SocketCAN interface, stm32ld_cbbl -can vcan0 ...
+// The link is timed like the real one. A byte (or CAN frame) only reaches
+// the device once it has gone through the line at the link rate, and a
+// reply leaves the line at the link rate, then takes the reply latency (a
+// USB adapter) to reach the host. The latency is a pipeline delay, the
+// device goes on with the next bytes meanwhile.
+// The FLASH behaves as on the STM32F1: erased bytes read 0xFF and
+// programming a byte that is not erased fails (PGERR, the block is NACKed).
+// The protocol constants are kept here, apart from the loader ones, so the
+// model checks the loader against its own copy of the protocol.
+
+#define _GNU_SOURCE
+
+#include "type.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+// Protocol
+#define STM32SIM_ACK          0x79
+#define STM32SIM_NACK         0x1F
+enum
+{
+  STM32SIM_CMD_INIT = 0x7F,
+  STM32SIM_CMD_GET_COMMAND = 0x00,
+  STM32SIM_CMD_GET_ID = 0x02,
+  STM32SIM_CMD_READ = 0x11,
+  STM32SIM_CMD_GO = 0x21,
+  STM32SIM_CMD_WRITE = 0x31,
+  STM32SIM_CMD_ERASE = 0x43,
+  STM32SIM_CMD_EXT_ERASE = 0x44,
+  STM32SIM_CMD_WRITE_UNPROTECT = 0x73,
+  STM32SIM_CMD_CAN_FRAMING = 0xA0,
+  STM32SIM_CMD_CAN_FD = 0xA1,
+  STM32SIM_CMD_ERASE_ASYNC = 0xA3,
+  STM32SIM_CMD_WRITE_EXT = 0xA4,
+  STM32SIM_CMD_WRITE_WINDOW = 0xA5,
+  STM32SIM_CMD_CRC = 0xA7,
+  STM32SIM_CMD_SET_BAUD = 0xA8,
+};
+
+// Device
+#define STM32SIM_CHIP_ID      0x0410 // STM32F1 medium density, 128 KB
+#define STM32SIM_VERSION      0x22
+#define STM32SIM_FLASH_BASE   0x08000000
+#define STM32SIM_PAGE_SIZE    1024
+#define STM32SIM_PAGES        128
+#define STM32SIM_FLASH_SIZE   ( STM32SIM_PAGES * STM32SIM_PAGE_SIZE )
+#define STM32SIM_OB_BASE      0x1FFFF800
+#define STM32SIM_OB_SIZE      16
+#define STM32SIM_MAX_BLOCK    2048 // largest write block
+#define STM32SIM_MAX_REPLY    ( 256 + 2 ) // largest reply, a read block
+#define STM32SIM_MAX_CMDS     32
+#define STM32SIM_WINDOW_HDRSIZE 7 // sequence number, address, length - 1
+#define STM32SIM_BAUD_CONFIRM 500000000 // ns for the init byte at a new rate
+
+// Link
+#define STM32SIM_BAUD         115200 // rate when the host side rate is not a standard one
+#define STM32SIM_BITRATE      1000000
+#define STM32SIM_DBITRATE     4000000
+#define STM32SIM_CAN_BROADCAST      0x000
+#define STM32SIM_CAN_TO_NODE( n )   ( 0x100u + ( n ) )
+#define STM32SIM_CAN_FROM_NODE( n ) ( 0x180u + ( n ) )
+#define STM32SIM_MAX_NODES    16
+#define STM32SIM_RXQUEUE      65536 // bytes waiting for each node, must be a power of 2
+#define STM32SIM_TXQUEUE      1024 // replies or frames waiting for their time, must be a power of 2
+#define STM32SIM_POLL         100000000 // ns, longest wait before checking for a stop
+#define STM32SIM_INF          ( ( u64 )-1 )
+
+// A received byte and the time it is through the line
+typedef struct
+{
+  u64 arrival; //ns, monotonic clock
+  u32 hostbaud; //host rate when it was sent, 0 if unknown
+  u8 byte;
+  u8 bcast; //came in a CAN broadcast frame
+} stm32sim_rxbyte;
+
+// A reply (USART) or a frame (CAN) waiting for its time
+typedef struct
+{
+  u64 due; //ns, monotonic clock
+  u32 id;
+  u32 len;
+  int fd; //CAN FD frame
+  u8 data[ STM32SIM_MAX_REPLY ];
+} stm32sim_tx;
+
+// One bootloader (a CAN node, or the device on the pty)
+typedef struct
+{
+  int node; //CAN node number
+  pthread_t thread;
+  int running;
+
+  // Receive queue, filled by the link reader
+  stm32sim_rxbyte rx[ STM32SIM_RXQUEUE ];
+  u32 rxhead, rxtail;
+  int lastbcast; //the last byte taken came in a broadcast
+  int skipbcast; //NACKed a broadcast transaction, broadcasts ignored until addressed
+
+  // Bootloader state
+  int synced;
+  sig_atomic_t resets; //resets taken (SIGUSR1)
+  jmp_buf resetjmp; //back to the bootloader start
+  u32 baud; //device rate, 0 until the first init byte
+  int framed; //up to 8 bytes per CAN frame
+  int fd; //bulk replies in CAN FD frames
+
+  // Memory
+  u8 flash[ STM32SIM_FLASH_SIZE ];
+  u8 ob[ STM32SIM_OB_SIZE ];
+  u64 erasedone[ STM32SIM_PAGES ]; //ns, end of a background erase
+
+  // Counters
+  u32 rxbytes, txbytes, rxframes, txframes, blocks, nacked, dropped, pgerrs, biterrors;
+} stm32sim_dev;
+
+// Settings and the link shared by the nodes
+typedef struct
+{
+  // Settings
+  const char *canif; //SocketCAN interface, NULL for the pty
+  u32 bitrate; //CAN bit rate
+  u32 dbitrate; //CAN FD data phase bit rate
+  u32 maxbaud; //highest rate the 0xA8 switch takes
+  u32 limit; //bit errors only above this rate, 0 for every rate
+  double ber; //bit error rate, both directions (USART)
+  u64 latency; //ns from the end of a reply on the line to the host
+  u64 erasetime; //ns per page
+  u64 progtime; //ns per KB programmed
+  u64 resettime; //ns the device is away after write unprotect
+  u32 nackevery; //NACK every nth write block, 0 for never
+  u32 dropevery; //program every nth write block but lose its ACK, 0 for never
+  int protect; //start with write protected pages
+  int once; //stop after GO
+  const char *dumpfile; //FLASH contents written there on exit, NULL for none
+  u8 cmds[ STM32SIM_MAX_CMDS ]; //GET command list
+  int ncmds;
+
+  // Link: pty master and slave, or the CAN socket
+  int fd, slave;
+  pthread_mutex_t lock;
+  pthread_cond_t rxcond, txcond;
+  u64 rxfree; //ns, the host to device line is free (USART)
+  u64 txfree; //ns, the device to host line is free (USART), the bus is free (CAN)
+  stm32sim_tx tx[ STM32SIM_TXQUEUE ];
+  u32 txhead, txtail;
+
+  // Nodes
+  stm32sim_dev *devs[ STM32SIM_MAX_NODES ];
+  int ndevs;
+} stm32sim_link;
+
+static stm32sim_link sim;
+static volatile sig_atomic_t stm32sim_stop;
+static volatile sig_atomic_t stm32sim_resets;
+
+// ****************************************************************************
+// Helper functions
+
+// Helper: monotonic time in ns
+static u64 stm32simh_now( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( u64 )ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Helper: sleep until the given time (ns, monotonic clock)
+static void stm32simh_sleep_until( u64 t )
+{
+  struct timespec ts;
+
+  ts.tv_sec = t / 1000000000;
+  ts.tv_nsec = t % 1000000000;
+  while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR );
+}
+
+// Helper: wait on a condition (link lock held) until the given time at most
+static void stm32simh_wait( pthread_cond_t *cond, u64 t )
+{
+  struct timespec ts;
+  u64 now = stm32simh_now();
+
+  if( t > now + STM32SIM_POLL )
+    t = now + STM32SIM_POLL;
+  ts.tv_sec = t / 1000000000;
+  ts.tv_nsec = t % 1000000000;
+  pthread_cond_timedwait( cond, &sim.lock, &ts );
+}
+
+// Helper: ns to send a byte at the given rate (start + 8 data + stop bits)
+static u64 stm32simh_byte_time( u32 baud )
+{
+  return 10000000000ULL / ( baud ? baud : STM32SIM_BAUD );
+}
+
+// Helper: ns a CAN frame of len bytes takes on the bus: 47 bits of frame
+// around the data, bit stuffing on about one bit in five
+static u64 stm32simh_frame_time( u32 len, int fd )
+{
+  // FD with a fast data phase: arbitration and end of frame at the nominal
+  // rate, control field, data and the 21 bit CRC at the data phase rate
+  if( fd )
+    return ( 30 + 15 ) * 1000000000ULL / sim.bitrate + ( 8 * len + 30 ) * 12 * 100000000ULL / sim.dbitrate;
+  return ( 47 + 8 * len + ( 34 + 8 * len ) / 5 ) * 1000000000ULL / sim.bitrate;
+}
+
+// Helper: rate set on the host side of the pty, 0 if not a standard one
+// (a BOTHER rate is taken as matching the device)
+#define SPEEDCASE(x)  case B##x: return x
+static u32 stm32simh_host_baud( void )
+{
+  struct termios tio;
+
+  if( sim.canif || tcgetattr( sim.slave, &tio ) == -1 )
+    return 0;
+  switch( cfgetospeed( &tio ) )
+  {
+    SPEEDCASE( 9600 );
+    SPEEDCASE( 19200 );
+    SPEEDCASE( 38400 );
+    SPEEDCASE( 57600 );
+    SPEEDCASE( 115200 );
+    SPEEDCASE( 230400 );
+#ifdef B460800
+    SPEEDCASE( 460800 );
+#endif
+#ifdef B921600
+    SPEEDCASE( 921600 );
+#endif
+#ifdef B1000000
+    SPEEDCASE( 1000000 );
+#endif
+#ifdef B1500000
+    SPEEDCASE( 1500000 );
+#endif
+#ifdef B2000000
+    SPEEDCASE( 2000000 );
+#endif
+#ifdef B3000000
+    SPEEDCASE( 3000000 );
+#endif
+#ifdef B4000000
+    SPEEDCASE( 4000000 );
+#endif
+  }
+  return 0;
+}
+
+// Helper: a byte through the USART line, garbled when the two ends are at
+// different rates, with bits flipped at the bit error rate
+static u8 stm32simh_line( stm32sim_dev *d, u8 b, u32 hostbaud )
+{
+  int bit;
+
+  if( sim.canif )
+    return b;
+  if( hostbaud && d->baud && hostbaud != d->baud )
+    return ( u8 )rand();
+  if( sim.limit && d->baud <= sim.limit )
+    return b;
+  if( sim.ber > 0 )
+    for( bit = 0; bit < 8; bit ++ )
+      if( rand() < sim.ber * RAND_MAX )
+      {
+        b ^= 1 << bit;
+        d->biterrors ++;
+      }
+  return b;
+}
+
+// Helper: queue a received byte for a node (link lock held)
+static void stm32simh_queue_rx( stm32sim_dev *d, u8 b, u64 arrival, u32 hostbaud, int bcast )
+{
+  stm32sim_rxbyte *e;
+
+  if( d->rxhead - d->rxtail >= STM32SIM_RXQUEUE )
+    return;
+  e = &d->rx[ d->rxhead ++ & ( STM32SIM_RXQUEUE - 1 ) ];
+  e->byte = b;
+  e->arrival = arrival;
+  e->hostbaud = hostbaud;
+  e->bcast = bcast;
+}
+
+// Helper: get a byte from the host once it is through the line, waiting
+// until the deadline at most (ns, STM32SIM_INF for no deadline).
+// Returns -1 on timeout.
+static int stm32simh_get_until( stm32sim_dev *d, u64 deadline )
+{
+  stm32sim_rxbyte e;
+  u64 now;
+
+  pthread_mutex_lock( &sim.lock );
+  while( 1 )
+  {
+    now = stm32simh_now();
+    // A reset ends whatever the node was doing
+    if( d->resets != stm32sim_resets )
+    {
+      d->resets = stm32sim_resets;
+      pthread_mutex_unlock( &sim.lock );
+      longjmp( d->resetjmp, 1 );
+    }
+    if( stm32sim_stop || now >= deadline )
+    {
+      pthread_mutex_unlock( &sim.lock );
+      return -1;
+    }
+    if( d->rxhead == d->rxtail )
+      stm32simh_wait( &sim.rxcond, deadline );
+    else if( d->rx[ d->rxtail & ( STM32SIM_RXQUEUE - 1 ) ].arrival > now )
+      stm32simh_wait( &sim.rxcond, d->rx[ d->rxtail & ( STM32SIM_RXQUEUE - 1 ) ].arrival < deadline ?
+          d->rx[ d->rxtail & ( STM32SIM_RXQUEUE - 1 ) ].arrival : deadline );
+    else
+    {
+      e = d->rx[ d->rxtail ++ & ( STM32SIM_RXQUEUE - 1 ) ];
+      // After a NACK in a broadcast transaction the node ignores the rest
+      // of it, until the host addresses it alone
+      if( d->skipbcast && e.bcast )
+        continue;
+      d->skipbcast = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock( &sim.lock );
+  d->lastbcast = e.bcast;
+  d->rxbytes ++;
+  return stm32simh_line( d, e.byte, e.hostbaud );
+}
+
+// Helper: get a byte from the host, no deadline
+static int stm32simh_get( stm32sim_dev *d )
+{
+  return stm32simh_get_until( d, STM32SIM_INF );
+}
+
+// Helper: get len bytes, XORing them into chk
+static void stm32simh_get_bytes( stm32sim_dev *d, u8 *dst, u32 len, u8 *chk )
+{
+  u32 i;
+
+  for( i = 0; i < len; i ++ )
+  {
+    dst[ i ] = ( u8 )stm32simh_get( d );
+    *chk ^= dst[ i ];
+  }
+}
+
+// Helper: drop the input that came in before now (device away)
+static void stm32simh_drop_input( stm32sim_dev *d )
+{
+  u64 now = stm32simh_now();
+
+  pthread_mutex_lock( &sim.lock );
+  while( d->rxhead != d->rxtail && d->rx[ d->rxtail & ( STM32SIM_RXQUEUE - 1 ) ].arrival <= now )
+    d->rxtail ++;
+  pthread_mutex_unlock( &sim.lock );
+}
+
+// Helper: queue a reply or a frame for the writer (link lock held). It
+// takes the line from when it is free, then the latency to reach the host.
+static void stm32simh_queue_tx( u32 id, const u8 *data, u32 len, int fd, u64 linetime )
+{
+  stm32sim_tx *t;
+  u64 now = stm32simh_now();
+
+  while( sim.txhead - sim.txtail >= STM32SIM_TXQUEUE )
+    stm32simh_wait( &sim.txcond, STM32SIM_INF );
+  if( sim.txfree < now )
+    sim.txfree = now;
+  sim.txfree += linetime;
+  t = &sim.tx[ sim.txhead ++ & ( STM32SIM_TXQUEUE - 1 ) ];
+  t->due = sim.txfree + sim.latency;
+  t->id = id;
+  t->len = len;
+  t->fd = fd;
+  memcpy( t->data, data, len );
+  pthread_cond_broadcast( &sim.txcond );
+}
+
+// Helper: send a reply. The caller goes on at once, the reply reaches the
+// host after its time on the line and the latency.
+static void stm32simh_put( stm32sim_dev *d, const u8 *src, u32 len )
+{
+  u8 buf[ STM32SIM_MAX_REPLY ];
+  u32 hostbaud = stm32simh_host_baud(), i, chunk;
+  int fd = 0;
+
+  if( len > sizeof( buf ) )
+    return;
+  for( i = 0; i < len; i ++ )
+    buf[ i ] = stm32simh_line( d, src[ i ], hostbaud );
+  d->txbytes += len;
+  pthread_mutex_lock( &sim.lock );
+  if( !sim.canif )
+    stm32simh_queue_tx( 0, buf, len, 0, len * stm32simh_byte_time( d->baud ) );
+  else
+  {
+    // One byte per frame, up to 8 once framing is on, bulk replies in FD
+    // frames once FD is on
+    fd = d->fd && len > CAN_MAX_DLEN;
+    for( i = 0; i < len; i += chunk )
+    {
+      chunk = d->framed ? ( len - i > CAN_MAX_DLEN ? CAN_MAX_DLEN : len - i ) : 1;
+      if( fd )
+        chunk = len - i >= 64 ? 64 : len - i >= 48 ? 48 : len - i >= 32 ? 32 : len - i >= 24 ? 24 :
+            len - i >= 20 ? 20 : len - i >= 16 ? 16 : len - i >= 12 ? 12 : len - i;
+      stm32simh_queue_tx( STM32SIM_CAN_FROM_NODE( d->node ), buf + i, chunk, fd, stm32simh_frame_time( chunk, fd ) );
+      d->txframes ++;
+    }
+  }
+  pthread_mutex_unlock( &sim.lock );
+}
+
+// Helper: send a single byte reply
+static void stm32simh_reply( stm32sim_dev *d, u8 b )
+{
+  if( b == STM32SIM_NACK && d->lastbcast )
+    d->skipbcast = 1;
+  stm32simh_put( d, &b, 1 );
+}
+
+// Helper: get an address and its checksum, -1 if the checksum is wrong
+static s64 stm32simh_get_address( stm32sim_dev *d )
+{
+  u8 a[ 4 ], chk = 0;
+
+  stm32simh_get_bytes( d, a, 4, &chk );
+  if( ( u8 )stm32simh_get( d ) != chk )
+    return -1;
+  return ( ( u32 )a[ 0 ] << 24 ) | ( ( u32 )a[ 1 ] << 16 ) | ( ( u32 )a[ 2 ] << 8 ) | a[ 3 ];
+}
+
+// Helper: memory behind an address range, NULL if outside the FLASH and
+// the option bytes
+static u8* stm32simh_mem( stm32sim_dev *d, u32 address, u32 len )
+{
+  if( address >= STM32SIM_FLASH_BASE && address + len <= STM32SIM_FLASH_BASE + STM32SIM_FLASH_SIZE )
+    return d->flash + ( address - STM32SIM_FLASH_BASE );
+  if( address >= STM32SIM_OB_BASE && address + len <= STM32SIM_OB_BASE + STM32SIM_OB_SIZE )
+    return d->ob + ( address - STM32SIM_OB_BASE );
+  return NULL;
+}
+
+// Helper: write protection, any WRP byte programmed
+static int stm32simh_protected( stm32sim_dev *d )
+{
+  int i;
+
+  for( i = 8; i < STM32SIM_OB_SIZE; i += 2 )
+    if( d->ob[ i ] != 0xFF )
+      return 1;
+  return 0;
+}
+
+// Helper: erase one page
+static void stm32simh_erase_page( stm32sim_dev *d, u32 page )
+{
+  if( page < STM32SIM_PAGES )
+    memset( d->flash + page * STM32SIM_PAGE_SIZE, 0xFF, STM32SIM_PAGE_SIZE );
+}
+
+// Helper: program a block the way the FLASH controller does, byte after
+// byte until one is not erased. Returns 0 on PGERR.
+static int stm32simh_program( stm32sim_dev *d, u32 address, const u8 *data, u32 len )
+{
+  u8 *dst = stm32simh_mem( d, address, len );
+  u32 i;
+
+  if( dst == NULL || dst < d->flash || dst >= d->flash + STM32SIM_FLASH_SIZE || stm32simh_protected( d ) )
+    return 0;
+
+  // Writes to a page held until its background erase is over
+  for( i = ( address - STM32SIM_FLASH_BASE ) / STM32SIM_PAGE_SIZE; i <= ( address + len - 1 - STM32SIM_FLASH_BASE ) / STM32SIM_PAGE_SIZE; i ++ )
+    stm32simh_sleep_until( d->erasedone[ i ] );
+  stm32simh_sleep_until( stm32simh_now() + sim.progtime * len / 1024 );
+  for( i = 0; i < len; i ++ )
+  {
+    if( dst[ i ] != 0xFF )
+    {
+      d->pgerrs ++;
+      return 0;
+    }
+    dst[ i ] = data[ i ];
+  }
+  return 1;
+}
+
+// Helper: count a write block and decide its fate: 1 to ACK it, 0 to
+// NACK it without programming, -1 to program it and lose the ACK
+static int stm32simh_block_fate( stm32sim_dev *d )
+{
+  d->blocks ++;
+  if( sim.nackevery && d->blocks % sim.nackevery == 0 )
+  {
+    d->nacked ++;
+    return 0;
+  }
+  if( sim.dropevery && d->blocks % sim.dropevery == 0 )
+  {
+    d->dropped ++;
+    return -1;
+  }
+  return 1;
+}
+
+// Helper: CRC-32 (IEEE 802.3, same as the loader)
+static u32 stm32simh_crc32( const u8 *data, u32 size )
+{
+  u32 crc = 0xFFFFFFFF, i;
+  int j;
+
+  for( i = 0; i < size; i ++ )
+  {
+    crc ^= data[ i ];
+    for( j = 0; j < 8; j ++ )
+      crc = ( crc >> 1 ) ^ ( 0xEDB88320 & -( crc & 1 ) );
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+static void stm32simh_signal( int sig )
+{
+  if( sig == SIGUSR1 )
+    stm32sim_resets ++;
+  else
+    stm32sim_stop = 1;
+}
+
+// ****************************************************************************
+// Link
+
+// Reader: timestamp the bytes (frames) from the host with the time they
+// are through the line and queue them for the nodes they are sent to.
+// A byte is never there before the host wrote it and the line carried it.
+static void* stm32sim_reader( void *arg )
+{
+  u8 buf[ 4096 ];
+  struct canfd_frame frame;
+  struct pollfd pfd;
+  stm32sim_dev *d;
+  u64 now, arrival;
+  u32 hostbaud;
+  ssize_t res, i;
+  int n, bcast;
+
+  ( void )arg;
+  pfd.fd = sim.fd;
+  pfd.events = POLLIN;
+  while( !stm32sim_stop )
+  {
+    if( poll( &pfd, 1, STM32SIM_POLL / 1000000 ) <= 0 )
+      continue;
+    if( !sim.canif )
+    {
+      if( ( res = read( sim.fd, buf, sizeof( buf ) ) ) <= 0 )
+        continue;
+      now = stm32simh_now();
+      hostbaud = stm32simh_host_baud();
+      d = sim.devs[ 0 ];
+      pthread_mutex_lock( &sim.lock );
+      if( sim.rxfree < now )
+        sim.rxfree = now;
+      for( i = 0; i < res; i ++ )
+      {
+        sim.rxfree += stm32simh_byte_time( hostbaud ? hostbaud : d->baud );
+        stm32simh_queue_rx( d, buf[ i ], sim.rxfree, hostbaud, 0 );
+      }
+    }
+    else
+    {
+      if( ( res = read( sim.fd, &frame, sizeof( frame ) ) ) <= 0 )
+        continue;
+      now = stm32simh_now();
+      pthread_mutex_lock( &sim.lock );
+      if( sim.txfree < now )
+        sim.txfree = now;
+      sim.txfree += stm32simh_frame_time( frame.len, res == CANFD_MTU );
+      arrival = sim.txfree;
+      bcast = frame.can_id == STM32SIM_CAN_BROADCAST;
+      for( n = 0; n < sim.ndevs; n ++ )
+        if( bcast || frame.can_id == STM32SIM_CAN_TO_NODE( sim.devs[ n ]->node ) )
+        {
+          sim.devs[ n ]->rxframes ++;
+          for( i = 0; i < frame.len; i ++ )
+            stm32simh_queue_rx( sim.devs[ n ], frame.data[ i ], arrival, 0, bcast );
+        }
+    }
+    pthread_cond_broadcast( &sim.rxcond );
+    pthread_mutex_unlock( &sim.lock );
+  }
+  return NULL;
+}
+
+// Writer: hand the replies (frames) to the host when they are due
+static void* stm32sim_writer( void *arg )
+{
+  stm32sim_tx t;
+  struct canfd_frame frame;
+
+  ( void )arg;
+  pthread_mutex_lock( &sim.lock );
+  while( !stm32sim_stop )
+  {
+    if( sim.txhead == sim.txtail )
+    {
+      stm32simh_wait( &sim.txcond, STM32SIM_INF );
+      continue;
+    }
+    t = sim.tx[ sim.txtail & ( STM32SIM_TXQUEUE - 1 ) ];
+    if( t.due > stm32simh_now() )
+    {
+      stm32simh_wait( &sim.txcond, t.due );
+      continue;
+    }
+    pthread_mutex_unlock( &sim.lock );
+    if( !sim.canif )
+    {
+      if( write( sim.fd, t.data, t.len ) != ( ssize_t )t.len )
+        perror( "stm32sim: write" );
+    }
+    else
+    {
+      memset( &frame, 0, sizeof( frame ) );
+      frame.can_id = t.id;
+      frame.len = t.len;
+      memcpy( frame.data, t.data, t.len );
+      if( t.fd )
+        frame.flags = CANFD_BRS;
+      if( write( sim.fd, &frame, t.fd ? CANFD_MTU : CAN_MTU ) == -1 )
+        perror( "stm32sim: CAN write" );
+    }
+    pthread_mutex_lock( &sim.lock );
+    sim.txtail ++;
+    pthread_cond_broadcast( &sim.txcond );
+  }
+  pthread_mutex_unlock( &sim.lock );
+  return NULL;
+}
+
+// Open the pty, print the slave name for the loader
+static int stm32sim_open_pty( void )
+{
+  struct termios tio;
+
+  // The slave stays open here too, the loader can come and go
+  if( ( sim.fd = posix_openpt( O_RDWR | O_NOCTTY ) ) == -1 || grantpt( sim.fd ) == -1 || unlockpt( sim.fd ) == -1 ||
+      ( sim.slave = open( ptsname( sim.fd ), O_RDWR | O_NOCTTY ) ) == -1 )
+  {
+    perror( "stm32sim: pty" );
+    return -1;
+  }
+  tcgetattr( sim.slave, &tio );
+  cfmakeraw( &tio );
+  tcsetattr( sim.slave, TCSANOW, &tio );
+  printf( "%s\n", ptsname( sim.fd ) );
+  return 0;
+}
+
+// Open a raw socket on the CAN interface
+static int stm32sim_open_can( void )
+{
+  struct sockaddr_can addr;
+  struct ifreq ifr;
+  int enable = 1;
+
+  if( ( sim.fd = socket( PF_CAN, SOCK_RAW, CAN_RAW ) ) == -1 )
+  {
+    perror( "stm32sim: CAN socket" );
+    return -1;
+  }
+  memset( &ifr, 0, sizeof( ifr ) );
+  strncpy( ifr.ifr_name, sim.canif, IFNAMSIZ - 1 );
+  if( ioctl( sim.fd, SIOCGIFINDEX, &ifr ) == -1 )
+  {
+    perror( "stm32sim: unknown CAN interface" );
+    return -1;
+  }
+  if( setsockopt( sim.fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof( enable ) ) == -1 )
+    fprintf( stderr, "stm32sim: no CAN FD on %s\n", sim.canif );
+  memset( &addr, 0, sizeof( addr ) );
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if( bind( sim.fd, ( struct sockaddr* )&addr, sizeof( addr ) ) == -1 )
+  {
+    perror( "stm32sim: CAN bind" );
+    return -1;
+  }
+  printf( "%s\n", sim.canif );
+  return 0;
+}
+
+// Print the counters and dump the FLASH of every node
+static void stm32sim_report( void )
+{
+  char name[ 256 ];
+  stm32sim_dev *d;
+  FILE *f;
+  int n;
+
+  for( n = 0; n < sim.ndevs; n ++ )
+  {
+    d = sim.devs[ n ];
+    if( sim.canif )
+      fprintf( stderr, "stm32sim: node %d: %lu bytes in %lu frames, %lu bytes out in %lu frames", d->node,
+          d->rxbytes, d->rxframes, d->txbytes, d->txframes );
+    else
+      fprintf( stderr, "stm32sim: %lu bytes in, %lu out", d->rxbytes, d->txbytes );
+    fprintf( stderr, ", %lu write blocks, %lu NACKed, %lu ACKs lost, %lu PGERR, %lu bit errors\n",
+        d->blocks, d->nacked, d->dropped, d->pgerrs, d->biterrors );
+    if( !sim.dumpfile )
+      continue;
+    if( sim.ndevs > 1 )
+      snprintf( name, sizeof( name ), "%s.%d", sim.dumpfile, d->node );
+    else
+      snprintf( name, sizeof( name ), "%s", sim.dumpfile );
+    if( ( f = fopen( name, "wb" ) ) != NULL )
+    {
+      fwrite( d->flash, 1, STM32SIM_FLASH_SIZE, f );
+      fclose( f );
+    }
+  }
+}
+
+// ****************************************************************************
+// Commands
+
+// Write memory: 0x31 (N = 1 byte) or 0xA4 (N = 2 bytes), ACK after each phase
+static void stm32sim_write( stm32sim_dev *d, u8 cmd )
+{
+  u8 data[ STM32SIM_MAX_BLOCK ], n[ 2 ], chk = 0;
+  u32 len;
+  s64 address;
+  int fate;
+
+  stm32simh_reply( d, STM32SIM_ACK );
+  if( ( address = stm32simh_get_address( d ) ) == -1 )
+  {
+    stm32simh_reply( d, STM32SIM_NACK );
+    return;
+  }
+  stm32simh_reply( d, STM32SIM_ACK );
+  if( cmd == STM32SIM_CMD_WRITE_EXT )
+  {
+    stm32simh_get_bytes( d, n, 2, &chk );
+    len = ( ( ( u32 )n[ 0 ] << 8 ) | n[ 1 ] ) + 1;
+  }
+  else
+  {
+    stm32simh_get_bytes( d, n, 1, &chk );
+    len = n[ 0 ] + 1;
+  }
+  if( len > sizeof( data ) )
+  {
+    stm32simh_reply( d, STM32SIM_NACK );
+    return;
+  }
+  stm32simh_get_bytes( d, data, len, &chk );
+  if( ( u8 )stm32simh_get( d ) != chk || ( fate = stm32simh_block_fate( d ) ) == 0 ||
+      !stm32simh_program( d, ( u32 )address, data, len ) )
+    stm32simh_reply( d, STM32SIM_NACK );
+  else if( fate == 1 )
+    stm32simh_reply( d, STM32SIM_ACK );
+  ( void )cmd;
+}
+
+// Windowed write (0xA5): seq, address, length - 1 (2 bytes), data, checksum,
+// answered with ACK/NACK + seq only
+static void stm32sim_write_window( stm32sim_dev *d )
+{
+  u8 hdr[ STM32SIM_WINDOW_HDRSIZE ], data[ STM32SIM_MAX_BLOCK ], reply[ 2 ], chk = 0;
+  u32 address, len;
+  int fate;
+
+  stm32simh_get_bytes( d, hdr, STM32SIM_WINDOW_HDRSIZE, &chk );
+  address = ( ( u32 )hdr[ 1 ] << 24 ) | ( ( u32 )hdr[ 2 ] << 16 ) | ( ( u32 )hdr[ 3 ] << 8 ) | hdr[ 4 ];
+  len = ( ( ( u32 )hdr[ 5 ] << 8 ) | hdr[ 6 ] ) + 1;
+  reply[ 0 ] = STM32SIM_NACK;
+  reply[ 1 ] = hdr[ 0 ];
+  if( len > sizeof( data ) )
+  {
+    stm32simh_put( d, reply, 2 );
+    return;
+  }
+  stm32simh_get_bytes( d, data, len, &chk );
+  if( ( u8 )stm32simh_get( d ) == chk && ( fate = stm32simh_block_fate( d ) ) != 0 &&
+      stm32simh_program( d, address, data, len ) )
+  {
+    if( fate == -1 )
+      return;
+    reply[ 0 ] = STM32SIM_ACK;
+  }
+  stm32simh_put( d, reply, 2 );
+}
+
+// Read memory: ACK, address, ACK, N and its checksum, ACK + N + 1 bytes
+static void stm32sim_read( stm32sim_dev *d )
+{
+  u8 buf[ 1 + 256 ], n;
+  u8 *mem;
+  s64 address;
+
+  stm32simh_reply( d, STM32SIM_ACK );
+  if( ( address = stm32simh_get_address( d ) ) == -1 )
+  {
+    stm32simh_reply( d, STM32SIM_NACK );
+    return;
+  }
+  stm32simh_reply( d, STM32SIM_ACK );
+  n = ( u8 )stm32simh_get( d );
+  if( ( u8 )stm32simh_get( d ) != n || ( mem = stm32simh_mem( d, ( u32 )address, n + 1 ) ) == NULL )
+  {
+    stm32simh_reply( d, STM32SIM_NACK );
+    return;
+  }
+  buf[ 0 ] = STM32SIM_ACK;
+  memcpy( buf + 1, mem, n + 1 );
+  stm32simh_put( d, buf, n + 2 );
+}
+
+// Erase: 0x43 (0xFF for a mass erase, or N and N + 1 page numbers) or 0x44
+// (16 bit N and page numbers), then the checksum
+static void stm32sim_erase( stm32sim_dev *d, u8 cmd )
+{
+  u8 buf[ 2 * 256 ], chk = 0;
+  u32 n, i, page;
+
+  stm32simh_reply( d, STM32SIM_ACK );
+  if( cmd == STM32SIM_CMD_EXT_ERASE )
+  {
+    stm32simh_get_bytes( d, buf, 2, &chk );
+    n = ( ( u32 )buf[ 0 ] << 8 ) | buf[ 1 ];
+  }
+  else
+  {
+    stm32simh_get_bytes( d, buf, 1, &chk );
+    n = buf[ 0 ];
+    if( n == 0xFF )
+    {
+      // CBBL mass erase, no checksum
+      stm32simh_sleep_until( stm32simh_now() + sim.erasetime );
+      for( page = 0; page < STM32SIM_PAGES; page ++ )
+        stm32simh_erase_page( d, page );
+      stm32simh_reply( d, STM32SIM_ACK );
+      return;
+    }
+  }
+  if( n >= STM32SIM_PAGES )
+  {
+    stm32simh_reply( d, STM32SIM_NACK );
+    return;
+  }
+  stm32simh_get_bytes( d, buf, ( n + 1 ) * ( cmd == STM32SIM_CMD_EXT_ERASE ? 2 : 1 ), &chk );
+  if( ( u8 )stm32simh_get( d ) != chk || stm32simh_protected( d ) )
+  {
+    stm32simh_reply( d, STM32SIM_NACK );
+    return;
+  }
+  for( i = 0; i <= n; i ++ )
+  {
+    page = cmd == STM32SIM_CMD_EXT_ERASE ? ( ( u32 )buf[ 2 * i ] << 8 ) | buf[ 2 * i + 1 ] : buf[ i ];
+    stm32simh_sleep_until( stm32simh_now() + sim.erasetime );
+    stm32simh_erase_page( d, page );
+  }
+  stm32simh_reply( d, STM32SIM_ACK );
+}
+
+// Background page erase (0xA3): page and checksum, ACKed as it starts
+static void stm32sim_erase_async( stm32sim_dev *d )
+{
+  u8 page, chk = 0;
+
+  stm32simh_reply( d, STM32SIM_ACK );
+  stm32simh_get_bytes( d, &page, 1, &chk );
+  if( ( u8 )stm32simh_get( d ) != chk || page >= STM32SIM_PAGES || stm32simh_protected( d ) )
+  {
+    stm32simh_reply( d, STM32SIM_NACK );
+    return;
+  }
+  stm32simh_erase_page( d, page );
+  d->erasedone[ page ] = stm32simh_now() + sim.erasetime;
+  stm32simh_reply( d, STM32SIM_ACK );
+}
+
+// CRC (0xA7): ACK, address, ACK, size and checksum, ACK + CRC[4] + ACK
+static void stm32sim_crc( stm32sim_dev *d )
+{
+  u8 buf[ 6 ], chk = 0;
+  u8 *mem;
+  u32 size, crc;
+  s64 address;
+
+  stm32simh_reply( d, STM32SIM_ACK );
+  if( ( address = stm32simh_get_address( d ) ) == -1 )
+  {
+    stm32simh_reply( d, STM32SIM_NACK );
+    return;
+  }
+  stm32simh_reply( d, STM32SIM_ACK );
+  stm32simh_get_bytes( d, buf, 4, &chk );
+  size = ( ( u32 )buf[ 0 ] << 24 ) | ( ( u32 )buf[ 1 ] << 16 ) | ( ( u32 )buf[ 2 ] << 8 ) | buf[ 3 ];
+  if( ( u8 )stm32simh_get( d ) != chk || ( mem = stm32simh_mem( d, ( u32 )address, size ) ) == NULL )
+  {
+    stm32simh_reply( d, STM32SIM_NACK );
+    return;
+  }
+  crc = stm32simh_crc32( mem, size );
+  buf[ 0 ] = STM32SIM_ACK;
+  buf[ 1 ] = crc >> 24;
+  buf[ 2 ] = ( crc >> 16 ) & 0xFF;
+  buf[ 3 ] = ( crc >> 8 ) & 0xFF;
+  buf[ 4 ] = crc & 0xFF;
+  buf[ 5 ] = STM32SIM_ACK;
+  stm32simh_put( d, buf, 6 );
+}
+
+// Baud rate switch (0xA8): rate and checksum, ACKed at the old rate, then
+// confirmed by an init byte at the new one within STM32SIM_BAUD_CONFIRM
+static void stm32sim_set_baud( stm32sim_dev *d )
+{
+  u8 buf[ 4 ], chk = 0;
+  u32 baud, old = d->baud;
+  u64 deadline;
+
+  stm32simh_reply( d, STM32SIM_ACK );
+  stm32simh_get_bytes( d, buf, 4, &chk );
+  baud = ( ( u32 )buf[ 0 ] << 24 ) | ( ( u32 )buf[ 1 ] << 16 ) | ( ( u32 )buf[ 2 ] << 8 ) | buf[ 3 ];
+  if( ( u8 )stm32simh_get( d ) != chk || baud == 0 || baud > sim.maxbaud )
+  {
+    stm32simh_reply( d, STM32SIM_NACK );
+    return;
+  }
+  stm32simh_reply( d, STM32SIM_ACK );
+
+  // The switch happens once the ACK is out
+  stm32simh_sleep_until( sim.txfree );
+  d->baud = baud;
+  deadline = stm32simh_now() + STM32SIM_BAUD_CONFIRM;
+  while( stm32simh_now() < deadline )
+    if( stm32simh_get_until( d, deadline ) == STM32SIM_CMD_INIT )
+    {
+      stm32simh_reply( d, STM32SIM_ACK );
+      return;
+    }
+  d->baud = old;
+}
+
+// Write unprotect: both ACKs, then a reset. The device is away for the
+// reset time and loses the input meanwhile.
+static void stm32sim_write_unprotect( stm32sim_dev *d )
+{
+  int i;
+
+  stm32simh_reply( d, STM32SIM_ACK );
+  for( i = 8; i < STM32SIM_OB_SIZE; i += 2 )
+  {
+    d->ob[ i ] = 0xFF;
+    d->ob[ i + 1 ] = 0x00;
+  }
+  stm32simh_reply( d, STM32SIM_ACK );
+  // -reset 0: back at once, nothing is lost
+  if( sim.resettime )
+  {
+    stm32simh_sleep_until( stm32simh_now() + sim.resettime );
+    stm32simh_drop_input( d );
+  }
+  d->synced = 0;
+}
+
+// Go: ACK, address, ACK, then the application starts (a new session
+// finds the bootloader again, as after a reset into it)
+static int stm32sim_go( stm32sim_dev *d )
+{
+  s64 address;
+
+  stm32simh_reply( d, STM32SIM_ACK );
+  if( ( address = stm32simh_get_address( d ) ) == -1 )
+  {
+    stm32simh_reply( d, STM32SIM_NACK );
+    return 0;
+  }
+  stm32simh_reply( d, STM32SIM_ACK );
+  if( sim.canif )
+    fprintf( stderr, "stm32sim: node %d: go %08lX\n", d->node, ( u32 )address );
+  else
+    fprintf( stderr, "stm32sim: go %08lX\n", ( u32 )address );
+  d->synced = 0;
+  return sim.once;
+}
+
+// ****************************************************************************
+// Bootloader
+
+static void* stm32sim_node( void *arg )
+{
+  stm32sim_dev *d = ( stm32sim_dev* )arg;
+  u8 buf[ 5 + STM32SIM_MAX_CMDS ];
+  int cmd;
+
+  // Reset (SIGUSR1, as the reset button): the FLASH is kept, the input
+  // that reached the device is lost. It takes effect at the next byte the
+  // node waits for.
+  if( setjmp( d->resetjmp ) )
+  {
+    stm32simh_drop_input( d );
+    d->synced = 0;
+    d->skipbcast = 0;
+  }
+  while( !stm32sim_stop )
+  {
+    // Bootloader start: the init byte sets the USART rate (autobaud),
+    // multi-byte CAN frames are off
+    if( !d->synced )
+    {
+      d->baud = 0;
+      if( stm32simh_get( d ) == STM32SIM_CMD_INIT )
+      {
+        d->baud = stm32simh_host_baud();
+        d->framed = 0;
+        d->fd = 0;
+        stm32simh_reply( d, STM32SIM_ACK );
+        d->synced = 1;
+      }
+      continue;
+    }
+
+    // Command and complement
+    if( ( cmd = stm32simh_get( d ) ) == -1 )
+      continue;
+    if( stm32simh_get( d ) != ( ~cmd & 0xFF ) || memchr( sim.cmds, cmd, sim.ncmds ) == NULL )
+    {
+      stm32simh_reply( d, STM32SIM_NACK );
+      continue;
+    }
+    switch( cmd )
+    {
+      case STM32SIM_CMD_GET_COMMAND:
+        buf[ 0 ] = STM32SIM_ACK;
+        buf[ 1 ] = sim.ncmds;
+        buf[ 2 ] = STM32SIM_VERSION;
+        memcpy( buf + 3, sim.cmds, sim.ncmds );
+        buf[ 3 + sim.ncmds ] = STM32SIM_ACK;
+        stm32simh_put( d, buf, 4 + sim.ncmds );
+        break;
+
+      case STM32SIM_CMD_GET_ID:
+        buf[ 0 ] = STM32SIM_ACK;
+        buf[ 1 ] = 1;
+        buf[ 2 ] = STM32SIM_CHIP_ID >> 8;
+        buf[ 3 ] = STM32SIM_CHIP_ID & 0xFF;
+        buf[ 4 ] = STM32SIM_ACK;
+        stm32simh_put( d, buf, 5 );
+        break;
+
+      case STM32SIM_CMD_READ:
+        stm32sim_read( d );
+        break;
+
+      case STM32SIM_CMD_WRITE:
+      case STM32SIM_CMD_WRITE_EXT:
+        stm32sim_write( d, cmd );
+        break;
+
+      case STM32SIM_CMD_WRITE_WINDOW:
+        stm32sim_write_window( d );
+        break;
+
+      case STM32SIM_CMD_ERASE:
+      case STM32SIM_CMD_EXT_ERASE:
+        stm32sim_erase( d, cmd );
+        break;
+
+      case STM32SIM_CMD_ERASE_ASYNC:
+        stm32sim_erase_async( d );
+        break;
+
+      case STM32SIM_CMD_CRC:
+        stm32sim_crc( d );
+        break;
+
+      case STM32SIM_CMD_SET_BAUD:
+        stm32sim_set_baud( d );
+        break;
+
+      case STM32SIM_CMD_CAN_FRAMING:
+        // The ACK goes out in a one byte frame, framing is on after it
+        stm32simh_reply( d, sim.canif ? STM32SIM_ACK : STM32SIM_NACK );
+        d->framed = sim.canif != NULL;
+        break;
+
+      case STM32SIM_CMD_CAN_FD:
+        stm32simh_reply( d, sim.canif ? STM32SIM_ACK : STM32SIM_NACK );
+        d->fd = sim.canif != NULL;
+        break;
+
+      case STM32SIM_CMD_WRITE_UNPROTECT:
+        stm32sim_write_unprotect( d );
+        break;
+
+      case STM32SIM_CMD_GO:
+        if( stm32sim_go( d ) )
+        {
+          d->running = 0;
+          return NULL;
+        }
+        break;
+    }
+  }
+  d->running = 0;
+  return NULL;
+}
+
+// ****************************************************************************
+// Entry point
+
+// Helper: parse a list of numbers (hex for the command lists)
+static int stm32simh_list( const char *s, u8 *dst, int max, int base )
+{
+  char *p = ( char* )s;
+  int n = 0;
+
+  while( *p && n < max )
+  {
+    dst[ n ++ ] = ( u8 )strtoul( p, &p, base );
+    if( *p == ',' )
+      p ++;
+    else if( *p )
+      break;
+  }
+  return n;
+}
+
+int main( int argc, const char **argv )
+{
+  static const u8 basecmds[] =
+  {
+    STM32SIM_CMD_GET_COMMAND, STM32SIM_CMD_GET_ID, STM32SIM_CMD_READ, STM32SIM_CMD_GO,
+    STM32SIM_CMD_WRITE, STM32SIM_CMD_ERASE, STM32SIM_CMD_WRITE_UNPROTECT
+  };
+  static const u8 extcmds[] =
+  {
+    STM32SIM_CMD_ERASE_ASYNC,
+    STM32SIM_CMD_WRITE_EXT,
+    STM32SIM_CMD_WRITE_WINDOW,
+    STM32SIM_CMD_CRC,
+    0
+  };
+  u8 nodes[ STM32SIM_MAX_NODES ] = { 0 };
+  const char *ext = NULL;
+  pthread_t reader, writer;
+  pthread_condattr_t attr;
+  stm32sim_dev *d;
+  int i, n, nnodes = 1, running, pending;
+
+  sim.bitrate = STM32SIM_BITRATE;
+  sim.dbitrate = STM32SIM_DBITRATE;
+  sim.maxbaud = 4000000;
+  sim.erasetime = 20000000;
+  sim.resettime = 30000000;
+  // Several models side by side get different bit errors
+  srand( ( unsigned )getpid() );
+  for( i = 1; i < argc; i ++ )
+  {
+    if( strcmp( argv[ i ], "-help" ) == 0 || i + 1 >= argc )
+    {
+      fprintf( stderr, "Program usage: ./stm32sim [-can interface] [options]\n"
+          "prints the pty to give the loader (or the CAN interface), then answers until stopped\n"
+          "(kill -USR1 resets the device, the FLASH kept)\n"
+          "-can interface answer on a SocketCAN interface (e.g. vcan0) instead of a pty\n"
+          "-bitrate n CAN bit rate the frames are timed at (default 1000000)\n" );
+      fprintf( stderr, "-dbitrate n CAN FD data phase bit rate (default 4000000)\n" );
+      fprintf( stderr, "-nodes n1,n2,... CAN nodes to model, one bootloader each (default one node, 0)\n" );
+      fprintf( stderr, "-ext list CBBL commands listed besides the standard ones, in hex, or none\n"
+          "-latency us from the end of a reply on the line to the host (16000 for an FTDI\n"
+          "\tadapter at its default latency timer)\n" );
+      fprintf( stderr, "-maxbaud n highest rate the 0xA8 switch takes (default 4000000)\n"
+          "-limit baud bit errors only above that rate\n" );
+      fprintf( stderr, "-ber x USART bit error rate, both directions\n"
+          "-erase us per page (default 20000), -program us per KB (default 0)\n"
+          "-reset us the device is away after write unprotect (default 30000)\n"
+          "-nack n NACK every nth write block, -dropack n lose the ACK of every nth one\n"
+          "-protect 1 start with write protected pages, -once 1 stop after GO\n"
+          "-dump file FLASH contents written to file (file.node with several nodes) on exit\n\n" );
+      exit( 1 );
+    }
+    if( strcmp( argv[ i ], "-can" ) == 0 )
+      sim.canif = argv[ ++ i ];
+    else if( strcmp( argv[ i ], "-bitrate" ) == 0 )
+      sim.bitrate = strtoul( argv[ ++ i ], NULL, 0 );
+    else if( strcmp( argv[ i ], "-dbitrate" ) == 0 )
+      sim.dbitrate = strtoul( argv[ ++ i ], NULL, 0 );
+    else if( strcmp( argv[ i ], "-nodes" ) == 0 )
+      nnodes = stm32simh_list( argv[ ++ i ], nodes, STM32SIM_MAX_NODES, 0 );
+    else if( strcmp( argv[ i ], "-ext" ) == 0 )
+      ext = argv[ ++ i ];
+    else if( strcmp( argv[ i ], "-maxbaud" ) == 0 )
+      sim.maxbaud = strtoul( argv[ ++ i ], NULL, 0 );
+    else if( strcmp( argv[ i ], "-limit" ) == 0 )
+      sim.limit = strtoul( argv[ ++ i ], NULL, 0 );
+    else if( strcmp( argv[ i ], "-ber" ) == 0 )
+      sim.ber = atof( argv[ ++ i ] );
+    else if( strcmp( argv[ i ], "-latency" ) == 0 )
+      sim.latency = strtoull( argv[ ++ i ], NULL, 0 ) * 1000;
+    else if( strcmp( argv[ i ], "-erase" ) == 0 )
+      sim.erasetime = strtoull( argv[ ++ i ], NULL, 0 ) * 1000;
+    else if( strcmp( argv[ i ], "-program" ) == 0 )
+      sim.progtime = strtoull( argv[ ++ i ], NULL, 0 ) * 1000;
+    else if( strcmp( argv[ i ], "-reset" ) == 0 )
+      sim.resettime = strtoull( argv[ ++ i ], NULL, 0 ) * 1000;
+    else if( strcmp( argv[ i ], "-nack" ) == 0 )
+      sim.nackevery = strtoul( argv[ ++ i ], NULL, 0 );
+    else if( strcmp( argv[ i ], "-dropack" ) == 0 )
+      sim.dropevery = strtoul( argv[ ++ i ], NULL, 0 );
+    else if( strcmp( argv[ i ], "-protect" ) == 0 )
+      sim.protect = atoi( argv[ ++ i ] );
+    else if( strcmp( argv[ i ], "-once" ) == 0 )
+      sim.once = atoi( argv[ ++ i ] );
+    else if( strcmp( argv[ i ], "-dump" ) == 0 )
+      sim.dumpfile = argv[ ++ i ];
+    else
+    {
+      fprintf( stderr, "stm32sim: unknown argument %s, use -help for details\n", argv[ i ] );
+      exit( 1 );
+    }
+  }
+  if( nnodes < 1 || ( nnodes > 1 && !sim.canif ) )
+  {
+    fprintf( stderr, "stm32sim: several nodes need -can\n" );
+    exit( 1 );
+  }
+
+  // Command list: the standard commands, then the CBBL extensions, all of
+  // the ones for the link by default (CAN framing on CAN, baud rate switch
+  // on the USART)
+  memcpy( sim.cmds, basecmds, sizeof( basecmds ) );
+  sim.ncmds = sizeof( basecmds );
+  if( ext && strcmp( ext, "none" ) != 0 )
+    sim.ncmds += stm32simh_list( ext, sim.cmds + sim.ncmds, STM32SIM_MAX_CMDS - sim.ncmds, 16 );
+  else if( !ext )
+  {
+    if( sim.canif )
+    {
+      sim.cmds[ sim.ncmds ++ ] = STM32SIM_CMD_CAN_FRAMING;
+      sim.cmds[ sim.ncmds ++ ] = STM32SIM_CMD_CAN_FD;
+    }
+    memcpy( sim.cmds + sim.ncmds, extcmds, sizeof( extcmds ) - 1 );
+    sim.ncmds += sizeof( extcmds ) - 1;
+    if( !sim.canif )
+      sim.cmds[ sim.ncmds ++ ] = STM32SIM_CMD_SET_BAUD;
+  }
+
+  // Link
+  pthread_mutex_init( &sim.lock, NULL );
+  pthread_condattr_init( &attr );
+  pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+  pthread_cond_init( &sim.rxcond, &attr );
+  pthread_cond_init( &sim.txcond, &attr );
+  if( ( sim.canif ? stm32sim_open_can() : stm32sim_open_pty() ) == -1 )
+    exit( 1 );
+  fflush( stdout );
+  signal( SIGINT, stm32simh_signal );
+  signal( SIGTERM, stm32simh_signal );
+  signal( SIGUSR1, stm32simh_signal );
+
+  // Nodes: erased FLASH, option bytes with their complements: RDP level 0,
+  // the user bytes erased, WRP 0x00 (all pages protected) with -protect
+  for( n = 0; n < nnodes; n ++ )
+  {
+    if( ( d = calloc( 1, sizeof( stm32sim_dev ) ) ) == NULL )
+      exit( 1 );
+    d->node = nodes[ n ];
+    memset( d->flash, 0xFF, sizeof( d->flash ) );
+    for( i = 0; i < STM32SIM_OB_SIZE; i += 2 )
+    {
+      d->ob[ i ] = i == 0 ? 0xA5 : i >= 8 && sim.protect ? 0x00 : 0xFF;
+      d->ob[ i + 1 ] = ~d->ob[ i ];
+    }
+    sim.devs[ sim.ndevs ++ ] = d;
+  }
+  pthread_create( &reader, NULL, stm32sim_reader, NULL );
+  pthread_create( &writer, NULL, stm32sim_writer, NULL );
+  for( n = 0; n < sim.ndevs; n ++ )
+  {
+    sim.devs[ n ]->running = 1;
+    pthread_create( &sim.devs[ n ]->thread, NULL, stm32sim_node, sim.devs[ n ] );
+  }
+
+  // Until stopped, or until every node went to the application with -once
+  do
+  {
+    usleep( 1000 );
+    for( n = running = 0; n < sim.ndevs; n ++ )
+      running += sim.devs[ n ]->running;
+  } while( !stm32sim_stop && running );
+
+  // Let the last replies out, and on the pty to the loader: closing the
+  // master drops what the slave still holds (1 s at most)
+  while( sim.txhead != sim.txtail && !stm32sim_stop )
+    usleep( 1000 );
+  for( n = 0; n < 1000 && !sim.canif && !stm32sim_stop; n ++ )
+  {
+    if( ioctl( sim.slave, FIONREAD, &pending ) == -1 || pending == 0 )
+      break;
+    usleep( 1000 );
+  }
+  stm32sim_stop = 1;
+  for( n = 0; n < sim.ndevs; n ++ )
+    pthread_join( sim.devs[ n ]->thread, NULL );
+  stm32sim_report();
+  return 0;
+}